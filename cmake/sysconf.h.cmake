@@ -7,6 +7,7 @@
 #cmakedefine HAVE_BACKTRACE 1
 #cmakedefine HAVE_SETJMP_H 1
 #cmakedefine HAVE_SYS_EPOLL_H 1
+#cmakedefine HAVE_LINUX_IO_URING_H 1
 #cmakedefine HAVE_GETTIMEOFDAY 1
 #cmakedefine HAVE_SETGRENT 1
 #cmakedefine HAVE_STRCASECMP 1
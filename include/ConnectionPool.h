@@ -0,0 +1,126 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include "Socket.h"
+#include "Future.h"
+#include "Timer.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class ConnectionPool;
+
+// A connection that goes back to its ConnectionPool when the caller is done
+// with it instead of being closed. Mix it in like ConnectionSocket, eg.
+//   class Backend : public BufferedSocket, public PooledSocket
+// OnConnect() and OnError() are the pool's, call ours if you override them.
+class PooledSocket : public ConnectionSocket
+{
+	friend class ConnectionPool;
+
+	ConnectionPool *pool;
+	std::string		key;
+	// Idle connections belong to the pool and anything the peer does to
+	// them gets them closed.
+	std::atomic<bool> idle;
+	bool			  connecting;
+	time_t			  idleSince;
+
+  public:
+	PooledSocket(bool ipv6);
+	virtual ~PooledSocket();
+
+	bool MultiplexEvent();
+
+	// Still connected with nothing from the peer waiting to be read and,
+	// as a BufferedSocket, nothing of ours waiting to be sent.
+	bool Healthy();
+
+	void OnConnect();
+	void OnError(const Flux::string &str);
+};
+
+// Keeps connections to each (address, port) open between requests so that
+// only the first pays for the handshake. Acquire() hands out an idle
+// connection if there is a healthy one, opens a new one if the destination
+// has fewer than maxPerHost, and otherwise waits for one to be released.
+//
+// Idle connections are watched by the multiplexer and closed when the peer
+// closes them or they have been idle for idleTimeout seconds, the latter
+// through the Timer subsystem so TimerHandler::TickTimers() has to be run.
+// The pool has to outlive its connections, delete it after
+// SocketMultiplexer::Terminate().
+class ConnectionPool : public Timer
+{
+	friend class PooledSocket;
+
+	typedef struct
+	{
+		Flux::string address;
+		short		 port;
+		// Open or opening.
+		size_t total, connecting;
+		// Most recently used at the back.
+		std::deque<PooledSocket *>			idle;
+		std::vector<PooledSocket *>			sockets;
+		std::deque<Promise<PooledSocket *>> waiters;
+	} host_t;
+
+	std::mutex								lock;
+	std::unordered_map<std::string, host_t> hosts;
+	size_t									maxPerHost, maxIdle;
+	time_t									idleTimeout;
+
+	// Must hold lock for these.
+	void   Close(PooledSocket *s);
+	size_t Refill(host_t &h);
+
+	void Open(const std::string &key, const Flux::string &address, short port, size_t count);
+	void Connected(PooledSocket *s);
+	void Failed(const std::string &key, PooledSocket *s, const Flux::string &error);
+	void Closed(PooledSocket *s);
+
+  public:
+	// maxIdle is per destination as well.
+	ConnectionPool(size_t maxPerHost = 64, size_t maxIdle = 16, time_t idleTimeout = 30);
+	virtual ~ConnectionPool();
+
+	// Completes straight away with an idle connection, otherwise on the new
+	// connection's reactor once it's connected. Fails with a
+	// SocketException if connecting did.
+	Future<PooledSocket *> Acquire(const Flux::string &address, short port);
+	// Give a connection back once it's done with a request. Without reuse,
+	// or if it isn't healthy (including still having sends queued), it's
+	// closed instead.
+	void Release(PooledSocket *s, bool reuse = true);
+
+	void Tick(time_t now);
+
+	// Make a new connection to address, the pool connects it.
+	virtual PooledSocket *OnCreate(const Flux::string &address, short port) = 0;
+};
@@ -0,0 +1,303 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include "ThreadEngine.h"
+#include "Future.h"
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <utility>
+
+// Coroutines which run on the ThreadHandler workers.
+//
+// A CoTask<T> is a coroutine returning T which starts when it is first
+// awaited. co_await one from another coroutine to run it and get its
+// result, or Start() it on a pool and get a Future for the result. A
+// suspended coroutine holds no thread, so a connection handler can wait
+// for its socket (see Socket::Readable()) or sleep (see SleepFor) in
+// straight line code without a thread per connection.
+//
+// Whenever something wakes a coroutine it is queued on the pool the
+// coroutine runs on rather than resumed on the waking thread, so the
+// multiplexer and the pool monitor never end up running handlers. A
+// CoTask inherits its pool from whoever awaits it.
+//
+// It isn't called Task because that is already the thread engine's job type.
+
+template<typename T> class CoTask;
+
+// The pool the coroutine behind h runs on, if it has one
+template<typename P>
+ThreadHandler *CoroutinePool(std::coroutine_handle<P> h)
+{
+	if constexpr (requires { h.promise().pool; })
+		return h.promise().pool;
+	else
+		return nullptr;
+}
+
+// Queue h on pool, or resume it right here if there isn't one
+inline void ResumeCoroutine(ThreadHandler *pool, std::coroutine_handle<> h)
+{
+	if (pool)
+		pool->Enqueue([h]() { h.resume(); });
+	else
+		h.resume();
+}
+
+// State common to every CoTask promise
+class CoPromiseBase
+{
+  public:
+	// Pool we are resumed on
+	ThreadHandler *pool;
+	// Who to resume when we finish
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	CoPromiseBase() : pool(nullptr) {}
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+		// Hand the thread straight to whoever awaited us, the result is
+		// already in our promise so there's no need to go through the queue.
+		template<typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			if (h.promise().continuation)
+				return h.promise().continuation;
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { this->error = std::current_exception(); }
+};
+
+template<typename T>
+class CoPromise : public CoPromiseBase
+{
+  public:
+	std::optional<T> value;
+
+	template<typename U>
+	void return_value(U &&v) { this->value.emplace(std::forward<U>(v)); }
+
+	T Result()
+	{
+		if (this->error)
+			std::rethrow_exception(this->error);
+		return std::move(*this->value);
+	}
+};
+
+template<>
+class CoPromise<void> : public CoPromiseBase
+{
+  public:
+	void return_void() {}
+
+	void Result()
+	{
+		if (this->error)
+			std::rethrow_exception(this->error);
+	}
+};
+
+// A coroutine started by CoTask::Start(), it owns the CoTask it runs and
+// frees itself when done.
+class CoDetached
+{
+  public:
+	class promise_type
+	{
+	  public:
+		ThreadHandler *pool;
+
+		promise_type() : pool(nullptr) {}
+		CoDetached get_return_object() { return CoDetached(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		// Everything is caught and handed to the Promise before we get here.
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+
+	explicit CoDetached(std::coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+template<typename T>
+class CoTask
+{
+  public:
+	class promise_type : public CoPromise<T>
+	{
+	  public:
+		CoTask get_return_object() { return CoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+	};
+
+  private:
+	std::coroutine_handle<promise_type> handle;
+
+	explicit CoTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+	static CoDetached RunDetached(CoTask task, Promise<T> promise)
+	{
+		try
+		{
+			if constexpr (std::is_void<T>::value)
+			{
+				co_await task;
+				promise.set_value();
+			}
+			else
+				promise.set_value(co_await task);
+		}
+		catch (...)
+		{
+			promise.set_exception(std::current_exception());
+		}
+	}
+
+  public:
+	CoTask() : handle(nullptr) {}
+	CoTask(CoTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	CoTask &operator=(CoTask &&other) noexcept
+	{
+		if (this != &other)
+		{
+			if (this->handle)
+				this->handle.destroy();
+			this->handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+	CoTask(const CoTask &) = delete;
+	CoTask &operator=(const CoTask &) = delete;
+
+	~CoTask()
+	{
+		if (this->handle)
+			this->handle.destroy();
+	}
+
+	bool valid() const { return this->handle != nullptr; }
+
+	// Awaiting a CoTask starts it on the awaiting thread and resumes the
+	// awaiter when it finishes.
+	struct Awaiter
+	{
+		std::coroutine_handle<promise_type> handle;
+
+		bool await_ready() noexcept { return !this->handle || this->handle.done(); }
+
+		template<typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiter) noexcept
+		{
+			promise_type &p = this->handle.promise();
+			p.continuation = awaiter;
+			if (!p.pool)
+				p.pool = CoroutinePool(awaiter);
+			return this->handle;
+		}
+
+		T await_resume() { return this->handle.promise().Result(); }
+	};
+
+	Awaiter operator co_await() & noexcept { return Awaiter{ this->handle }; }
+	Awaiter operator co_await() && noexcept { return Awaiter{ this->handle }; }
+
+	// Run the coroutine on pool without waiting for it. The CoTask is
+	// empty afterwards, the Future gets the result.
+	Future<T> Start(ThreadHandler &pool)
+	{
+		this->handle.promise().pool = &pool;
+
+		Promise<T> promise(&pool);
+		Future<T> future = promise.get_future();
+		CoDetached d = RunDetached(std::move(*this), std::move(promise));
+		d.handle.promise().pool = &pool;
+		ResumeCoroutine(&pool, d.handle);
+		return future;
+	}
+};
+
+// co_await ResumeOn(pool) moves the coroutine onto one of pool's workers,
+// and makes pool the one it is resumed on from then on.
+class ResumeOn
+{
+	ThreadHandler &pool;
+
+  public:
+	explicit ResumeOn(ThreadHandler &pool) : pool(pool) {}
+
+	bool await_ready() noexcept { return false; }
+
+	template<typename P>
+	void await_suspend(std::coroutine_handle<P> h)
+	{
+		if constexpr (requires { h.promise().pool; })
+			h.promise().pool = &this->pool;
+		ResumeCoroutine(&this->pool, h);
+	}
+
+	void await_resume() noexcept {}
+};
+
+// co_await SleepFor(std::chrono::milliseconds(50)) suspends the coroutine
+// for at least that long without holding a thread. Outside a pool it
+// has to fall back to sleeping the thread.
+class SleepFor
+{
+	std::chrono::steady_clock::duration delay;
+
+  public:
+	template<typename Rep, typename Period>
+	explicit SleepFor(std::chrono::duration<Rep, Period> delay) : delay(std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay)) {}
+
+	bool await_ready() noexcept { return this->delay <= std::chrono::steady_clock::duration::zero(); }
+
+	template<typename P>
+	bool await_suspend(std::coroutine_handle<P> h)
+	{
+		ThreadHandler *pool = CoroutinePool(h);
+		if (!pool)
+		{
+			std::this_thread::sleep_for(this->delay);
+			return false;
+		}
+
+		pool->EnqueueAfter([h]() { h.resume(); }, this->delay);
+		return true;
+	}
+
+	void await_resume() noexcept {}
+};
@@ -0,0 +1,165 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include "Socket.h"
+#include "Future.h"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// clang-format off
+typedef enum
+{
+	DNS_A     = 1,
+	DNS_CNAME = 5,
+	DNS_SOA   = 6,
+	DNS_AAAA  = 28
+} dnsquery_t;
+// clang-format on
+
+class DNSSocket;
+class EyeballAttempt;
+class EyeballTimer;
+
+// A non-blocking stub resolver. Queries go over UDP to one nameserver and
+// the answers are handled by whichever reactor the resolver's socket ended
+// up on, nothing ever blocks on the network.
+//
+// Answers are cached for as long as their TTL says, NXDOMAIN and empty
+// answers for as long as the zone's SOA says. Lookups of a name that is
+// already being asked about wait for that query rather than sending their own.
+class DNSResolver
+{
+  public:
+	typedef std::vector<sockaddr_t> result_t;
+
+  protected:
+	friend class DNSSocket;
+	friend class DNSRetryTimer;
+
+	typedef struct
+	{
+		result_t							  addresses;
+		std::chrono::steady_clock::time_point expires;
+	} cacheentry_t;
+
+	typedef struct
+	{
+		uint16_t							  id;
+		dnsquery_t							  type;
+		std::string							  packet;
+		unsigned							  tries;
+		std::chrono::steady_clock::time_point sent;
+		std::vector<Promise<result_t>>		  waiters;
+	} query_t;
+
+	// Guards everything below.
+	static std::mutex Lock;
+	static bool		  Configured;
+	static sockaddr_t Nameserver;
+	static DNSSocket *Sock;
+	// Retransmits and times out queries while there are any.
+	static TimerSocket *Retry;
+	// Keyed by "name/type"
+	static std::unordered_map<std::string, cacheentry_t> Cache;
+	static std::unordered_map<std::string, query_t>		 Queries;
+	static std::unordered_map<uint16_t, std::string>	 IDs;
+	static std::unordered_multimap<std::string, sockaddr_t> Hosts;
+
+	// Must hold Lock for these.
+	static void LoadConfig();
+	static bool Send(query_t &q);
+	static std::vector<Promise<result_t>> Abandon();
+
+	static void Received(const unsigned char *packet, size_t len);
+	static void Tick();
+	static void Fail(std::vector<Promise<result_t>> &waiters, const Flux::string &error);
+
+  public:
+	// How long to wait for an answer and how often to ask.
+	static constexpr unsigned Timeout = 1000, Tries = 3;
+
+	// Where queries go, the first nameserver in /etc/resolv.conf unless
+	// this is called. Lookups still in flight fail.
+	static void SetNameserver(const Flux::string &address, short port = 53);
+
+	// Resolve host to DNS_A or DNS_AAAA addresses (with port 0). Literal
+	// addresses, /etc/hosts and the cache answer straight away. A name that
+	// doesn't exist has no addresses, timeouts, nameserver errors and
+	// answers truncated before any address fail with a DNSException.
+	// Continuations run on the resolver's reactor unless they were given
+	// a pool.
+	static Future<result_t> Resolve(const Flux::string &host, dnsquery_t type);
+
+	static void ClearCache();
+	static void Terminate();
+};
+
+// RFC 8305 Happy Eyeballs for ConnectionSocket::Connect() with a host name.
+// Both families are looked up at once and connection attempts to the
+// addresses start ConnectionAttemptDelay apart, alternating families and
+// IPv6 first. The first to connect wins and its fd goes to the
+// ConnectionSocket, everything else is cancelled. Runs on the socket's
+// reactor.
+class HappyEyeballs : public std::enable_shared_from_this<HappyEyeballs>
+{
+	friend class EyeballAttempt;
+	friend class EyeballTimer;
+
+	ConnectionSocket *cs;
+	short			  port;
+	unsigned		  reactor;
+
+	// Addresses yet to try, IPv6 then IPv4, and whether they have answered.
+	std::deque<sockaddr_t> addresses[2];
+	bool				   resolved[2];
+	// Which of the two to try next.
+	int			 next;
+	bool		 started;
+	Flux::string lastError;
+
+	std::vector<EyeballAttempt *> attempts;
+	EyeballTimer *				  timer;
+
+	void Resolved(int family, const DNSResolver::result_t *result, const Flux::string &error);
+	void Next();
+	void Arm(unsigned msec);
+	void Succeeded(EyeballAttempt *a);
+	void Failed(EyeballAttempt *a, const Flux::string &error);
+
+  public:
+	// How long to wait for the AAAA answer once the A answer is in, and how
+	// far apart to start connection attempts. Both from RFC 8305.
+	static constexpr unsigned ResolutionDelay = 50, ConnectionAttemptDelay = 250;
+
+	HappyEyeballs(ConnectionSocket *cs, short port);
+	~HappyEyeballs();
+
+	static std::shared_ptr<HappyEyeballs> Start(ConnectionSocket *cs, const Flux::string &host, short port);
+};
@@ -95,6 +95,8 @@ class File
 	virtual FILE *GetFILE();
 	// Get the file path
 	virtual inline Flux::string GetPath() { return this->path; }
+	// Get the file descriptor, eg. for Socket::SendFile()
+	inline int GetFD() { return this->fd; }
 
 	// String-style write functions
 	template<typename... Args>
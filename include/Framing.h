@@ -0,0 +1,131 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Cuts a received byte stream into frames, either lines ending in LF or
+// CRLF or messages behind a big-endian length prefix. Frames are handed
+// out as string_views into the data, nothing is copied.
+//
+// Line endings are looked for a vector at a time, with AVX2 if the CPU has
+// it, SSE2 otherwise and memchr() where neither exists. A partial line
+// isn't searched again when more of it arrives, so keep one Framer per
+// connection.
+class Framer
+{
+  public:
+	typedef enum
+	{
+		FRAME_LINES,
+		FRAME_LENGTH
+	} framing_t;
+
+  private:
+	framing_t type;
+	size_t	  max;
+	unsigned  prefix;
+	// How much of the partial frame the last Decode() left already was
+	// searched.
+	size_t scanned;
+
+  public:
+	// Frames longer than max break the stream. prefix is the size of the
+	// length in bytes, 1 to 8, and doesn't count towards the frame.
+	Framer(framing_t type = FRAME_LINES, size_t max = 65536, unsigned prefix = 4)
+		: type(type), max(max), prefix(std::clamp(prefix, 1u, 8u)), scanned(0)
+	{
+	}
+
+	// Offsets of the first count bytes equal to c in data, returns how many
+	// there were.
+	static size_t Find(const char *data, size_t len, char c, uint32_t *offsets, size_t count);
+
+	// Hands each complete frame in data to func, a bool(std::string_view)
+	// which returns false to stop there. used is set to how much of data
+	// they took up, data has to start with whatever is left the next time.
+	// Returns false if the stream is broken, a frame was over the limit.
+	template<typename F>
+	bool Decode(const char *data, size_t len, size_t &used, F &&func)
+	{
+		used = 0;
+		if (this->type == FRAME_LENGTH)
+		{
+			while (len - used >= this->prefix)
+			{
+				uint64_t size = 0;
+				for (unsigned i = 0; i < this->prefix; ++i)
+					size = size << 8 | static_cast<unsigned char>(data[used + i]);
+				if (size > this->max)
+					return false;
+				if (len - used - this->prefix < size)
+					break;
+
+				std::string_view frame(data + used + this->prefix, size);
+				used += this->prefix + size;
+				if (!func(frame))
+					break;
+			}
+			return true;
+		}
+
+		// Offsets are 32 bits, a gigabyte at a time is plenty.
+		static constexpr size_t Batch = 64, Chunk = 1 << 30;
+		uint32_t				offsets[Batch];
+		size_t					from = std::min(this->scanned, len);
+		this->scanned				 = 0;
+
+		while (from < len)
+		{
+			size_t n = Framer::Find(data + from, std::min(len - from, Chunk), '\n', offsets, Batch);
+			for (size_t i = 0; i < n; ++i)
+			{
+				size_t end = from + offsets[i], size = end - used;
+				if (size && data[end - 1] == '\r')
+					--size;
+				if (size > this->max)
+					return false;
+
+				std::string_view line(data + used, size);
+				used = end + 1;
+				if (!func(line))
+					return true;
+			}
+
+			if (n < Batch)
+				from += std::min(len - from, Chunk);
+			else
+				from += offsets[Batch - 1] + 1;
+		}
+
+		// The rest is a partial line.
+		if (len - used > this->max + 1)
+			return false;
+		this->scanned = len - used;
+		return true;
+	}
+};
@@ -0,0 +1,382 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include "ThreadEngine.h"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+// Futures and promises scheduled through the ThreadHandler.
+//
+// Unlike std::future these do not need a thread sitting in get(), a
+// continuation attached with then() is handed to the thread pool the
+// moment its input completes. Futures are cheap to copy and every copy
+// refers to the same result.
+
+template<typename T> class Future;
+template<typename T> class Promise;
+
+// void results are stored as std::monostate internally.
+template<typename T>
+using future_storage_t = typename std::conditional<std::is_void<T>::value, std::monostate, T>::type;
+
+// What a continuation attached to a Future<T> returns.
+template<typename F, typename T>
+struct continuation_result
+{
+	using type = std::invoke_result_t<F, const T &>;
+};
+
+template<typename F>
+struct continuation_result<F, void>
+{
+	using type = std::invoke_result_t<F>;
+};
+
+template<typename T>
+class FutureState
+{
+	std::mutex m;
+	std::condition_variable cv;
+	bool ready;
+	std::optional<future_storage_t<T>> value;
+	std::exception_ptr error;
+	// Jobs to hand to the pool once we're ready
+	std::vector<function_t> continuations;
+
+	void Complete()
+	{
+		std::vector<function_t> conts;
+		{
+			std::lock_guard<std::mutex> lk(this->m);
+			this->ready = true;
+			conts.swap(this->continuations);
+		}
+		this->cv.notify_all();
+
+		for (auto &c : conts)
+			this->Schedule(std::move(c));
+	}
+
+	void Schedule(function_t &&func)
+	{
+		// Without a pool just run it here.
+		if (this->pool)
+			this->pool->Enqueue(std::move(func));
+		else
+			func();
+	}
+
+  public:
+	ThreadHandler *pool;
+
+	FutureState(ThreadHandler *pool) : ready(false), pool(pool) {}
+
+	bool IsReady()
+	{
+		std::lock_guard<std::mutex> lk(this->m);
+		return this->ready;
+	}
+
+	template<typename... Args>
+	void SetValue(Args &&... args)
+	{
+		{
+			std::lock_guard<std::mutex> lk(this->m);
+			if (this->ready || this->value || this->error)
+				throw std::future_error(std::future_errc::promise_already_satisfied);
+			this->value.emplace(std::forward<Args>(args)...);
+		}
+		this->Complete();
+	}
+
+	void SetException(std::exception_ptr e)
+	{
+		{
+			std::lock_guard<std::mutex> lk(this->m);
+			if (this->ready || this->value || this->error)
+				throw std::future_error(std::future_errc::promise_already_satisfied);
+			this->error = e;
+		}
+		this->Complete();
+	}
+
+	// Run func on the pool once the result is available.
+	void OnReady(function_t &&func)
+	{
+		{
+			std::lock_guard<std::mutex> lk(this->m);
+			if (!this->ready)
+			{
+				this->continuations.push_back(std::move(func));
+				return;
+			}
+		}
+		this->Schedule(std::move(func));
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lk(this->m);
+		this->cv.wait(lk, [this]() { return this->ready; });
+	}
+
+	// Only valid once ready, the result is never modified after that.
+	const future_storage_t<T> &Get()
+	{
+		this->Wait();
+		if (this->error)
+			std::rethrow_exception(this->error);
+		return *this->value;
+	}
+
+	std::exception_ptr GetException()
+	{
+		this->Wait();
+		return this->error;
+	}
+};
+
+template<typename T>
+class Future
+{
+	std::shared_ptr<FutureState<T>> state;
+
+	template<typename U> friend class Promise;
+	template<typename U> friend class Future;
+	friend class ThreadHandler;
+
+	Future(const std::shared_ptr<FutureState<T>> &state) : state(state) {}
+
+  public:
+	Future() = default;
+
+	// Whether this future refers to a result at all.
+	bool valid() const { return this->state != nullptr; }
+	bool is_ready() const { return this->state->IsReady(); }
+
+	// Block until the result is available. Prefer then() for anything
+	// running on the thread pool itself.
+	void wait() const { this->state->Wait(); }
+
+	// Get the result (or rethrow the exception) blocking if need be.
+	decltype(auto) get() const
+	{
+		if constexpr (std::is_void<T>::value)
+			this->state->Get();
+		else
+			return static_cast<const T &>(this->state->Get());
+	}
+
+	// Schedule func on the thread pool once this future completes. func
+	// receives the result (or nothing for Future<void>) and its return
+	// value completes the returned future. If this future failed, func is
+	// skipped and the exception is passed along instead.
+	template<typename F>
+	auto then(F &&func) const
+	{
+		using result_t = typename continuation_result<std::decay_t<F>, T>::type;
+
+		auto next = std::make_shared<FutureState<result_t>>(this->state->pool);
+		std::shared_ptr<FutureState<T>> in = this->state;
+
+		this->state->OnReady([in, next, f = std::forward<F>(func)]() mutable {
+			std::exception_ptr e = in->GetException();
+			if (e)
+			{
+				next->SetException(e);
+				return;
+			}
+
+			try
+			{
+				if constexpr (std::is_void<T>::value && std::is_void<result_t>::value)
+				{
+					f();
+					next->SetValue();
+				}
+				else if constexpr (std::is_void<T>::value)
+					next->SetValue(f());
+				else if constexpr (std::is_void<result_t>::value)
+				{
+					f(static_cast<const T &>(in->Get()));
+					next->SetValue();
+				}
+				else
+					next->SetValue(f(static_cast<const T &>(in->Get())));
+			}
+			catch (...)
+			{
+				next->SetException(std::current_exception());
+			}
+		});
+
+		return Future<result_t>(next);
+	}
+
+	// Internal: the shared state, used by when_all/when_any.
+	const std::shared_ptr<FutureState<T>> &GetState() const { return this->state; }
+};
+
+template<typename T>
+class Promise
+{
+	std::shared_ptr<FutureState<T>> state;
+
+  public:
+	Promise(ThreadHandler *pool = nullptr) : state(std::make_shared<FutureState<T>>(pool)) {}
+	Promise(Promise &&) = default;
+	Promise &operator=(Promise &&) = default;
+	Promise(const Promise &) = delete;
+	Promise &operator=(const Promise &) = delete;
+
+	~Promise()
+	{
+		// Nobody is going to complete this, let whoever waits know about it.
+		if (this->state && !this->state->IsReady())
+			this->state->SetException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+	}
+
+	Future<T> get_future() const { return Future<T>(this->state); }
+
+	template<typename... Args>
+	void set_value(Args &&... args)
+	{
+		this->state->SetValue(std::forward<Args>(args)...);
+	}
+
+	void set_exception(std::exception_ptr e) { this->state->SetException(e); }
+};
+
+// Completes once every future in the list has completed. The values are
+// collected in the same order, the first exception (by position) wins.
+template<typename T>
+auto when_all(const std::vector<Future<T>> &futures)
+{
+	using result_t = typename std::conditional<std::is_void<T>::value, void, std::vector<future_storage_t<T>>>::type;
+
+	ThreadHandler *pool = futures.empty() ? nullptr : futures.front().GetState()->pool;
+	auto promise = std::make_shared<Promise<result_t>>(pool);
+	Future<result_t> ret = promise->get_future();
+
+	if (futures.empty())
+	{
+		if constexpr (std::is_void<T>::value)
+			promise->set_value();
+		else
+			promise->set_value(result_t());
+		return ret;
+	}
+
+	auto remaining = std::make_shared<std::atomic<size_t>>(futures.size());
+	auto inputs = std::make_shared<std::vector<Future<T>>>(futures);
+
+	for (const auto &f : futures)
+	{
+		// The last one to complete collects the results, no thread waits.
+		f.GetState()->OnReady([promise, remaining, inputs]() {
+			if (remaining->fetch_sub(1, std::memory_order_acq_rel) != 1)
+				return;
+
+			for (const auto &in : *inputs)
+			{
+				std::exception_ptr e = in.GetState()->GetException();
+				if (e)
+				{
+					promise->set_exception(e);
+					return;
+				}
+			}
+
+			if constexpr (std::is_void<T>::value)
+				promise->set_value();
+			else
+			{
+				result_t values;
+				values.reserve(inputs->size());
+				for (const auto &in : *inputs)
+					values.push_back(in.get());
+				promise->set_value(std::move(values));
+			}
+		});
+	}
+
+	return ret;
+}
+
+// Completes with the index of the first future in the list to complete.
+// That future is ready by then so calling get() on it will not block.
+template<typename T>
+Future<size_t> when_any(const std::vector<Future<T>> &futures)
+{
+	ThreadHandler *pool = futures.empty() ? nullptr : futures.front().GetState()->pool;
+	auto promise = std::make_shared<Promise<size_t>>(pool);
+	Future<size_t> ret = promise->get_future();
+	auto done = std::make_shared<std::atomic<bool>>(false);
+
+	for (size_t i = 0; i < futures.size(); ++i)
+	{
+		futures[i].GetState()->OnReady([promise, done, i]() {
+			if (!done->exchange(true, std::memory_order_acq_rel))
+				promise->set_value(i);
+		});
+	}
+
+	return ret;
+}
+
+template<class _Function, class... _Args>
+auto ThreadHandler::Async(_Function &&__f, _Args &&... __args)
+{
+	using result_t = std::invoke_result_t<std::decay_t<_Function>, std::decay_t<_Args>...>;
+
+	auto state = std::make_shared<FutureState<result_t>>(this);
+	this->Enqueue([state, f = std::forward<_Function>(__f), args = std::make_tuple(std::forward<_Args>(__args)...)]() mutable {
+		try
+		{
+			if constexpr (std::is_void<result_t>::value)
+			{
+				std::apply(f, std::move(args));
+				state->SetValue();
+			}
+			else
+				state->SetValue(std::apply(f, std::move(args)));
+		}
+		catch (...)
+		{
+			state->SetException(std::current_exception());
+		}
+	});
+
+	return Future<result_t>(state);
+}
@@ -0,0 +1,192 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// A bounded lock-free multi-producer multi-consumer queue.
+//
+// This is Dmitry Vyukov's ring buffer: every cell carries a sequence number
+// which says whether it is ready to be written (sequence == position) or read
+// (sequence == position + 1). Producers and consumers only contend on their
+// own position counter with a single CAS per operation and never on each
+// other. The capacity is rounded up to a power of two.
+template<typename T>
+class MPMCQueue
+{
+	typedef struct
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	} cell_t;
+
+	// Keep the two ends on their own cache lines so producers and
+	// consumers don't bounce a line between them.
+	alignas(64) std::atomic<size_t> enqueuePos;
+	alignas(64) std::atomic<size_t> dequeuePos;
+	alignas(64) cell_t *buffer;
+	size_t mask;
+
+  public:
+	MPMCQueue(size_t capacity = 65536) : buffer(nullptr) { this->Reset(capacity); }
+	~MPMCQueue() { delete[] this->buffer; }
+
+	MPMCQueue(const MPMCQueue &) = delete;
+	MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+	// Throw away the contents and reallocate, NOT safe while the queue is in use.
+	void Reset(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+
+		delete[] this->buffer;
+		this->buffer = new cell_t[size];
+		this->mask = size - 1;
+
+		for (size_t i = 0; i < size; ++i)
+			this->buffer[i].sequence.store(i, std::memory_order_relaxed);
+
+		this->enqueuePos.store(0, std::memory_order_relaxed);
+		this->dequeuePos.store(0, std::memory_order_relaxed);
+	}
+
+	// Returns false if the queue is full, data is only moved from on success.
+	bool Push(T &&data)
+	{
+		cell_t *cell;
+		size_t pos = this->enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &this->buffer[pos & this->mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+			if (dif == 0)
+			{
+				if (this->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+				return false;
+			else
+				pos = this->enqueuePos.load(std::memory_order_relaxed);
+		}
+
+		cell->data = std::move(data);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Move as many items from the front of q as there is room for, up to
+	// max, claiming the whole run of cells with a single CAS. Returns how
+	// many were moved.
+	template<typename Q>
+	size_t PushBatch(Q &q, size_t max = SIZE_MAX)
+	{
+		size_t want = q.size() < max ? q.size() : max;
+		if (!want)
+			return 0;
+
+		size_t pos = this->enqueuePos.load(std::memory_order_relaxed);
+		size_t count;
+		for (;;)
+		{
+			// Count the free cells following pos. A free cell can only be
+			// filled by whoever owns its position so once our CAS succeeds
+			// all of them are ours.
+			for (count = 0; count < want; ++count)
+			{
+				size_t seq = this->buffer[(pos + count) & this->mask].sequence.load(std::memory_order_acquire);
+				if (seq != pos + count)
+					break;
+			}
+
+			if (!count)
+			{
+				size_t seq = this->buffer[pos & this->mask].sequence.load(std::memory_order_acquire);
+				if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos) < 0)
+					return 0; // full
+				pos = this->enqueuePos.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (this->enqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+				break;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			cell_t *cell = &this->buffer[(pos + i) & this->mask];
+			cell->data = std::move(q.front());
+			q.pop_front();
+			cell->sequence.store(pos + i + 1, std::memory_order_release);
+		}
+
+		return count;
+	}
+
+	// Returns false if the queue is empty.
+	bool Pop(T &data)
+	{
+		cell_t *cell;
+		size_t pos = this->dequeuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &this->buffer[pos & this->mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+			if (dif == 0)
+			{
+				if (this->dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+				return false;
+			else
+				pos = this->dequeuePos.load(std::memory_order_relaxed);
+		}
+
+		data = std::move(cell->data);
+		cell->data = T();
+		cell->sequence.store(pos + this->mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Only a snapshot, other threads may change it at any moment.
+	size_t size() const
+	{
+		size_t tail = this->enqueuePos.load(std::memory_order_relaxed);
+		size_t head = this->dequeuePos.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+	bool empty() const { return this->size() == 0; }
+	size_t capacity() const { return this->mask + 1; }
+};
@@ -0,0 +1,209 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include "ThreadEngine.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+// Data-parallel algorithms run on the ThreadHandler workers.
+//
+// Ranges are split in half recursively, one half is handed to the pool
+// while the current thread carries on with the other. In work stealing
+// mode that gives idle workers large pieces to steal and keeps the small
+// pieces local. The thread that called the algorithm runs jobs while it
+// waits rather than sleeping so nothing is left idle.
+
+// A set of jobs that can be waited on as a whole.
+class TaskGroup
+{
+	ThreadHandler &pool;
+	std::atomic<size_t> pending;
+	std::exception_ptr error;
+	std::mutex errorLock;
+
+	// Help run jobs until everything in the group has completed.
+	void Join()
+	{
+		while (this->pending.load(std::memory_order_acquire))
+		{
+			if (!this->pool.TryRunJob())
+				std::this_thread::yield();
+		}
+	}
+
+  public:
+	TaskGroup(ThreadHandler &pool) : pool(pool), pending(0) {}
+	// The jobs may reference the caller's stack, never leave them behind.
+	~TaskGroup() { this->Join(); }
+
+	template<typename F>
+	void Run(F &&func)
+	{
+		this->pending.fetch_add(1, std::memory_order_relaxed);
+		this->pool.Enqueue([this, f = std::forward<F>(func)]() mutable {
+			try
+			{
+				f();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lk(this->errorLock);
+				if (!this->error)
+					this->error = std::current_exception();
+			}
+			this->pending.fetch_sub(1, std::memory_order_release);
+		});
+	}
+
+	// Wait for the group to complete, then rethrow the first exception
+	// any of the jobs threw.
+	void Wait()
+	{
+		this->Join();
+
+		std::exception_ptr e;
+		{
+			std::lock_guard<std::mutex> lk(this->errorLock);
+			std::swap(e, this->error);
+		}
+		if (e)
+			std::rethrow_exception(e);
+	}
+};
+
+// Split the chunks [first, last) until single chunks are left and call
+// body(chunk) on each of them.
+template<typename F>
+void ParallelChunks(TaskGroup &group, size_t first, size_t last, const F &body)
+{
+	while (last - first > 1)
+	{
+		size_t mid = first + (last - first) / 2;
+		group.Run([&group, &body, mid, last]() { ParallelChunks(group, mid, last, body); });
+		last = mid;
+	}
+
+	if (first < last)
+		body(first);
+}
+
+// Call fn(i) for every i in [begin, end), in chunks of at least grain.
+template<typename Index, typename F>
+void parallel_for(ThreadHandler &pool, Index begin, Index end, size_t grain, F &&fn)
+{
+	if (!(begin < end))
+		return;
+
+	size_t count = static_cast<size_t>(end - begin);
+	grain = std::max<size_t>(grain, 1);
+	size_t nchunks = (count + grain - 1) / grain;
+
+	TaskGroup group(pool);
+	ParallelChunks(group, 0, nchunks, [&](size_t chunk) {
+		Index first = begin + static_cast<Index>(chunk * grain);
+		Index last = begin + static_cast<Index>(std::min(count, (chunk + 1) * grain));
+		for (Index i = first; i < last; ++i)
+			fn(i);
+	});
+	group.Wait();
+}
+
+// Combine fn(i) for every i in [begin, end) with reduce, starting from
+// identity. reduce must be associative, the chunks are combined in
+// order so it doesn't need to be commutative.
+template<typename Index, typename T, typename F, typename R>
+T parallel_reduce(ThreadHandler &pool, Index begin, Index end, size_t grain, T identity, F &&fn, R &&reduce)
+{
+	if (!(begin < end))
+		return identity;
+
+	size_t count = static_cast<size_t>(end - begin);
+	grain = std::max<size_t>(grain, 1);
+	size_t nchunks = (count + grain - 1) / grain;
+
+	std::vector<T> partial(nchunks, identity);
+
+	TaskGroup group(pool);
+	ParallelChunks(group, 0, nchunks, [&](size_t chunk) {
+		Index first = begin + static_cast<Index>(chunk * grain);
+		Index last = begin + static_cast<Index>(std::min(count, (chunk + 1) * grain));
+		T acc = identity;
+		for (Index i = first; i < last; ++i)
+			acc = reduce(acc, fn(i));
+		partial[chunk] = std::move(acc);
+	});
+	group.Wait();
+
+	T result = identity;
+	for (auto &p : partial)
+		result = reduce(result, p);
+	return result;
+}
+
+// Store fn(*it) for every it in [first, last) into out, like std::transform.
+// Both iterators must be random access.
+template<typename InputIt, typename OutputIt, typename F>
+OutputIt parallel_transform(ThreadHandler &pool, InputIt first, InputIt last, OutputIt out, size_t grain, F &&fn)
+{
+	auto count = std::distance(first, last);
+	parallel_for(pool, decltype(count)(0), count, grain, [&](decltype(count) i) { out[i] = fn(first[i]); });
+	return out + count;
+}
+
+template<typename RandomIt, typename Compare>
+void ParallelMergeSort(ThreadHandler &pool, RandomIt first, RandomIt last, size_t grain, const Compare &comp)
+{
+	size_t count = static_cast<size_t>(last - first);
+	if (count <= grain)
+	{
+		std::sort(first, last, comp);
+		return;
+	}
+
+	RandomIt mid = first + count / 2;
+	{
+		// Sort the halves in parallel, helping out until both are done.
+		TaskGroup group(pool);
+		group.Run([&]() { ParallelMergeSort(pool, first, mid, grain, comp); });
+		ParallelMergeSort(pool, mid, last, grain, comp);
+		group.Wait();
+	}
+
+	std::inplace_merge(first, mid, last, comp);
+}
+
+// Merge sort [first, last) on the pool. Pieces of grain elements or less
+// are sorted with std::sort on whichever thread picked them up, so like
+// std::sort this is not a stable sort.
+template<typename RandomIt, typename Compare = std::less<>>
+void parallel_sort(ThreadHandler &pool, RandomIt first, RandomIt last, size_t grain = 2048, Compare comp = Compare())
+{
+	ParallelMergeSort(pool, first, last, std::max<size_t>(grain, 2), comp);
+}
@@ -0,0 +1,156 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sys/uio.h>
+
+// A growable byte ring for socket buffers.
+//
+// The capacity is always a power of two and head/tail run freely, so the
+// used and free space are each at most two contiguous pieces which can be
+// handed straight to readv(2)/writev(2) without copying. Not thread safe.
+class RingBuffer
+{
+	char * buffer;
+	size_t mask;
+	// Free running, the data lives in [head, tail).
+	size_t head, tail;
+
+  public:
+	RingBuffer(size_t capacity = 4096) : buffer(nullptr), mask(0), head(0), tail(0) { this->Reserve(capacity); }
+	~RingBuffer() { delete[] this->buffer; }
+
+	RingBuffer(const RingBuffer &) = delete;
+	RingBuffer &operator=(const RingBuffer &) = delete;
+
+	inline size_t size() const { return this->tail - this->head; }
+	inline bool   empty() const { return this->head == this->tail; }
+	inline size_t capacity() const { return this->buffer ? this->mask + 1 : 0; }
+	inline size_t available() const { return this->capacity() - this->size(); }
+
+	// Make room for at least len more bytes, keeping what's in there.
+	void Reserve(size_t len)
+	{
+		size_t used = this->size(), size = std::max<size_t>(this->capacity(), 2);
+		while (size < used + len)
+			size <<= 1;
+		if (size == this->capacity())
+			return;
+
+		char *buffer = new char[size];
+		this->Peek(buffer, used);
+		delete[] this->buffer;
+
+		this->buffer = buffer;
+		this->mask   = size - 1;
+		this->head   = 0;
+		this->tail   = used;
+	}
+
+	void Write(const void *data, size_t len)
+	{
+		this->Reserve(len);
+
+		size_t off = this->tail & this->mask, first = std::min(len, this->capacity() - off);
+		memcpy(this->buffer + off, data, first);
+		memcpy(this->buffer, static_cast<const char *>(data) + first, len - first);
+		this->tail += len;
+	}
+
+	// Copy out up to len bytes without consuming them.
+	size_t Peek(void *data, size_t len) const
+	{
+		len = std::min(len, this->size());
+		if (!len)
+			return 0;
+
+		size_t off = this->head & this->mask, first = std::min(len, this->capacity() - off);
+		memcpy(data, this->buffer + off, first);
+		memcpy(static_cast<char *>(data) + first, this->buffer, len - first);
+		return len;
+	}
+
+	size_t Read(void *data, size_t len)
+	{
+		len = this->Peek(data, len);
+		this->Consume(len);
+		return len;
+	}
+
+	// The data as at most two pieces, for writev(2). Returns how many.
+	int Data(iovec iov[2]) const
+	{
+		size_t used = this->size();
+		if (!used)
+			return 0;
+
+		size_t off = this->head & this->mask, first = std::min(used, this->capacity() - off);
+		iov[0] = { this->buffer + off, first };
+		iov[1] = { this->buffer, used - first };
+		return used > first ? 2 : 1;
+	}
+
+	// The free space as at most two pieces, for readv(2), after making sure
+	// there is at least min of it. Follow up with Commit().
+	int Space(iovec iov[2], size_t min)
+	{
+		this->Reserve(min);
+
+		size_t avail = this->available(), off = this->tail & this->mask, first = std::min(avail, this->capacity() - off);
+		iov[0] = { this->buffer + off, first };
+		iov[1] = { this->buffer, avail - first };
+		return avail > first ? 2 : 1;
+	}
+
+	// The data in one piece, moved to the start of the buffer if it wraps
+	// around, for parsing it in place.
+	const char *Linearize()
+	{
+		size_t used = this->size(), off = this->head & this->mask;
+		if (off + used > this->capacity())
+		{
+			std::rotate(this->buffer, this->buffer + off, this->buffer + this->capacity());
+			this->head = 0;
+			this->tail = used;
+		}
+		return this->buffer + (this->head & this->mask);
+	}
+
+	// Drop len bytes from the front, after they were written out.
+	void Consume(size_t len)
+	{
+		this->head += std::min(len, this->size());
+		// Starting over at the beginning keeps the next Data() in one piece.
+		if (this->head == this->tail)
+			this->head = this->tail = 0;
+	}
+
+	// Take len bytes that were read into the Space() we handed out.
+	void Commit(size_t len) { this->tail += std::min(len, this->available()); }
+
+	void Clear() { this->head = this->tail = 0; }
+};
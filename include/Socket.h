@@ -25,38 +25,68 @@
 #pragma once
 #include "Flux.h"
 #include "Utilities.h"
+#include "Coroutine.h"
+#include "Framing.h"
+#include "RingBuffer.h"
 #include <arpa/inet.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <vector>
+
+class File;
 
 typedef union
 {
 	struct sockaddr_in  ipv4;
 	struct sockaddr_in6 ipv6;
+	struct sockaddr_un  un;
 	struct sockaddr		sa;
 } sockaddr_t;
 
 // clang-format off
+// These are bit positions in the Flags<> bitset, not masks.
 typedef enum
 {
 	// Misc socket statuses.
-	SS_DEAD       = 1 << 1,
-	SS_WRITABLE   = 1 << 2,
+	SS_DEAD       = 1,
+	SS_WRITABLE   = 2,
 	// For connecting sockets
-	SS_CONNECTING = 1 << 3,
-	SS_CONNECTED  = 1 << 4,
+	SS_CONNECTING = 3,
+	SS_CONNECTED  = 4,
 	// For Binding sockets.
-	SS_ACCEPTING  = 1 << 5,
-	SS_ACCEPTED   = 1 << 6,
+	SS_ACCEPTING  = 5,
+	SS_ACCEPTED   = 6,
 	// Multiplexer statuses
-	MX_WRITABLE   = 1 << 7,
-	MX_READABLE   = 1 << 8
+	MX_WRITABLE   = 7,
+	MX_READABLE   = 8,
+	// Ask the multiplexer for edge-triggered notification. The socket must
+	// then read/write until EAGAIN every time it is told it is ready.
+	MX_EDGETRIGGERED = 9
 } socketstatus_t;
 // clang-format on
 
 class Socket : public Flags<socketstatus_t>
 {
+	friend class SocketMultiplexer;
+
   protected:
 	int		   sock_fd;
 	sockaddr_t sa;
+	// The reactor that owns us, see SocketMultiplexer.
+	unsigned reactor;
+
+	// One-shot callbacks for whoever is waiting on the socket
+	std::mutex waiterLock;
+	function_t readWaiter, writeWaiter;
+
+	// Data an engine already received for us (io_uring reads into its own
+	// buffers), Read() hands this out before touching the socket.
+	std::mutex  bufferLock;
+	std::string readBuffer;
 
   public:
 	// Delete the default constructor because it causes all kinds of fucking issues.
@@ -72,32 +102,248 @@ class Socket : public Flags<socketstatus_t>
 	virtual size_t Read(void *data, size_t len);
 
 	// Getters/Setters
-	inline int GetFD() { return this->sock_fd; }
+	inline int		GetFD() { return this->sock_fd; }
+	inline unsigned GetReactor() { return this->reactor; }
 
 	// Interaction with the SocketMultiplexer
 	virtual bool MultiplexEvent();
 	virtual void MultiplexError();
 	virtual bool MultiplexRead();
 	virtual bool MultiplexWrite();
+	// The socket has an error condition, return true if it was only
+	// notifications on the error queue (eg. MSG_ZEROCOPY completions) and
+	// the socket is otherwise fine.
+	virtual bool MultiplexErrorQueue();
+
+	// Run func once, the next time the socket is readable or writable. Only
+	// one waiter of each kind, a new one replaces the old. Don't delete the
+	// socket while something is waiting on it. Any thread, our reactor
+	// starts waiting once it gets round to it.
+	void OnReadable(function_t &&func);
+	void OnWritable(function_t &&func);
+	// Called by the multiplexer engines with what the socket is ready for
+	// after they call MultiplexRead()/MultiplexWrite(), so waiters find
+	// whatever those buffered. Runs the waiters and returns true if there
+	// were any.
+	bool NotifyWaiters(bool readable, bool writable);
+	// Used by engines that do the reading themselves.
+	void   Received(const void *data, size_t len);
+	size_t Buffered();
+
+	// Suspends a coroutine until the socket is ready, eg.
+	//   while (!done) { co_await sock->Readable(); n = sock->Read(buf, sizeof(buf)); ... }
+	// The coroutine is resumed on its pool, not on the multiplexer's thread.
+	struct ReadyAwaiter
+	{
+		Socket *s;
+		bool	write;
+
+		bool await_ready() noexcept { return false; }
+
+		template<typename P>
+		void await_suspend(std::coroutine_handle<P> h)
+		{
+			ThreadHandler *pool = CoroutinePool(h);
+			function_t resume([pool, h]() { ResumeCoroutine(pool, h); });
+			if (this->write)
+				this->s->OnWritable(std::move(resume));
+			else
+				this->s->OnReadable(std::move(resume));
+		}
 
+		void await_resume() noexcept {}
+	};
+
+	inline ReadyAwaiter Readable() { return ReadyAwaiter{ this, false }; }
+	inline ReadyAwaiter Writable() { return ReadyAwaiter{ this, true }; }
+
+	// For AF_UNIX the address is the path, or '@' and a name in the
+	// abstract namespace, see unix(7). There's no port.
 	static Flux::string GetAddress(sockaddr_t saddr);
 	static short		GetPort(sockaddr_t s);
 	static sockaddr_t   GetSockAddr(int type, const Flux::string &addr, int port);
+	// How much of saddr to give bind()/connect()/sendto().
+	static socklen_t GetSockLen(const sockaddr_t &saddr);
+
+	// A connected pair of UNIX sockets, SOCK_STREAM or SOCK_SEQPACKET, eg.
+	// to hand one end to a child process. Both are non-blocking.
+	static std::pair<int, int> Pair(int type = SOCK_STREAM);
+};
+
+// Mix in with ConnectionSocket/ClientSocket to get buffered I/O. Reads drain
+// the socket into a ring until EAGAIN, Write() queues and everything queued
+// goes out in one sendmsg() once the socket is writable. Write() can be
+// called from any thread, what we wait for is only changed on our reactor.
+//
+// When more than the high-water mark is waiting in either buffer the socket
+// stops reading (MX_READABLE is cleared) until it is down to half of it, so
+// a slow reader or a peer that won't take our writes doesn't make us buffer
+// without end.
+//
+// SendFile() and SendZeroCopy() skip copying into the send ring. They are
+// queued in order with Write() and go out from MultiplexWrite() too.
+//
+// Over a UNIX socket SendFD() hands the peer a copy of an fd, which comes
+// out of ReceiveFD() on the other end.
+class BufferedSocket : public virtual Socket
+{
+	// Sent from somewhere other than sendBuffer, after the byte of the
+	// ring it was queued behind.
+	typedef struct
+	{
+		uint64_t	at;
+		int			fd;   // sendfile() from this, or -1 for memory
+		int			pass; // SCM_RIGHTS this with the next byte, or -1
+		const char *data;
+		off_t		offset;
+		size_t		len;
+		// Zero copy sends, the counter the kernel gave the last piece
+		uint32_t   last;
+		function_t release;
+	} segment_t;
+
+	std::mutex recvLock, sendLock;
+	std::atomic<bool> paused, eof;
+
+	// Guarded by recvLock, fds the peer passed us, oldest first.
+	std::deque<int> passed;
+
+	// All guarded by sendLock. Bytes ever put in and taken out of sendBuffer.
+	uint64_t			  sendQueued, sendFlushed;
+	std::deque<segment_t> segments;
+	// Zero copy sends waiting for the kernel to let go of the memory.
+	std::deque<segment_t> zeroCopyPending;
+	// 1 once SO_ZEROCOPY is on, -1 if the kernel won't have it.
+	int		 zeroCopy;
+	uint32_t zeroCopyNext, zeroCopyDone;
+
+	void Pressure();
+	// Have our reactor bring MX_READABLE/MX_WRITABLE in line with the
+	// buffers, Dispatch() changes them there and two threads would undo
+	// each other's epoll_ctl()s.
+	void Rearm();
+	void Queue(segment_t &&seg);
+	// Must hold sendLock, moves whatever the kernel is done with to done.
+	bool ReapZeroCopy(std::vector<function_t> &done);
+
+  protected:
+	RingBuffer recvBuffer, sendBuffer;
+	// 0 for no limit.
+	size_t recvHighWater, sendHighWater;
+
+  public:
+	// Below this zero copy costs more than copying, see MSG_ZEROCOPY in
+	// the kernel's msg_zerocopy.rst.
+	static constexpr size_t ZeroCopyMin = 16384;
+
+	BufferedSocket();
+	virtual ~BufferedSocket();
+
+	// Queues the data, this always takes all of it.
+	size_t Write(const void *data, size_t len);
+	inline size_t Write(const Flux::string &str) { return this->Write(str.c_str(), str.size()); }
+	// Only hands out what's buffered. Like recv(2), -1 with EAGAIN if there
+	// is nothing yet and 0 once the peer closed and everything was read.
+	size_t Read(void *data, size_t len);
+
+	// Queue len bytes of the file from offset, sent straight from the page
+	// cache with sendfile(2). The file has to stay open until done runs.
+	void SendFile(File *f, off_t offset, size_t len, function_t &&done = function_t());
+	// Queue the memory for a MSG_ZEROCOPY send. It must not change until the
+	// kernel reports it is done with it and release runs. Small buffers, or
+	// if the kernel can't do it, are copied like Write() and released
+	// straight away.
+	void SendZeroCopy(const void *data, size_t len, function_t &&release);
+	// Queue data like Write() with a copy of fd attached to its first byte,
+	// there has to be at least one. The caller keeps their fd.
+	void SendFD(int fd, const void *data, size_t len);
+	// The next fd the peer passed, or -1. Each arrives with the byte it was
+	// sent with, so it is here by the time OnRead() sees that. It is ours
+	// to close.
+	int ReceiveFD();
+
+	// Hands every complete frame in the receive buffer to func, see
+	// Framer::Decode(), and drops them. The string_views point into the
+	// buffer and are only good until func returns, which must not Read()
+	// from us. Returns false if the peer broke the framing.
+	template<typename F>
+	bool ReadFrames(Framer &framer, F &&func)
+	{
+		size_t used;
+		bool   ok;
+		{
+			std::lock_guard<std::mutex> lk(this->recvLock);
+			const char *				data = this->recvBuffer.Linearize();
+			ok								 = framer.Decode(data, this->recvBuffer.size(), used, func);
+			this->recvBuffer.Consume(used);
+		}
+
+		this->Pressure();
+		return ok;
+	}
+
+	bool MultiplexRead();
+	bool MultiplexWrite();
+	bool MultiplexErrorQueue();
+
+	// Called after a read put something in recvBuffer, or once the peer
+	// closed. Return false to close the socket.
+	virtual bool OnRead() = 0;
+
+	void SetHighWater(size_t recv, size_t send);
+	// Bytes read but not taken out yet, and not sent yet including what
+	// SendFile() and SendZeroCopy() queued.
+	size_t ReadQueued();
+	size_t WriteQueued();
 };
 
+// A timerfd, so timeouts run on a reactor like everything else and with
+// better than the second resolution Timer has. Runs func on the reactor it
+// was created on after msec milliseconds and then every interval if there
+// is one. Without an interval the timer deletes itself once it has run.
+class TimerSocket : public Socket
+{
+	function_t func;
+	bool	   once;
+
+  public:
+	TimerSocket(unsigned msec, unsigned interval, function_t &&func = function_t());
+
+	// Restart the countdown, or stop it, from any thread.
+	void Arm(unsigned msec, unsigned interval = 0);
+	void Disarm();
+
+	bool MultiplexRead();
+	// Runs func, or override it instead.
+	virtual void Tick();
+};
+
+class HappyEyeballs;
+
 class ConnectionSocket : public virtual Socket
 {
 	Flux::string address;
 	short		 port;
+	// Racing the addresses of a host name, see DNS.h.
+	std::shared_ptr<HappyEyeballs> eyeballs;
 
   public:
 	ConnectionSocket(bool ipv6);
+	// Around an fd that is connected already, eg. one end of Socket::Pair().
+	// OnConnect() isn't called.
+	ConnectionSocket(int fd, const sockaddr_t &addr);
 	virtual ~ConnectionSocket();
 
 	bool MultiplexEvent();
 	void MultiplexError();
 
+	// Host names are resolved without blocking and the first of their
+	// addresses to answer wins, OnConnect() or OnError() tell which way it
+	// went. An address starting with '/' or '@' is a UNIX socket, the
+	// socket has to be AF_UNIX for that.
 	void Connect(const Flux::string &address, short port);
+	// Take over fd, connected to addr, in place of our own socket.
+	void Connected(int fd, const sockaddr_t &addr);
 
 	virtual void OnConnect() = 0;
 	virtual void OnError(const Flux::string &str);
@@ -107,16 +353,42 @@ class ClientSocket;
 
 class ListeningSocket : public virtual Socket
 {
+	// Next reactor to hand a connection to when spreading them.
+	std::atomic<unsigned> nextReactor;
+
   protected:
 	Flux::string address;
 	short		 port;
 	bool		 ipv6;
+	// Connections accepted per readiness event at most, so one busy
+	// listener can't starve the rest of the reactor.
+	size_t acceptBatch;
+	bool   spread;
+
+	void Adopt(int fd, const sockaddr_t &addr);
 
   public:
-	ListeningSocket(const Flux::string &bindaddr, short port, bool ipv6);
+	// With reuseport several listeners can share the port and the kernel
+	// spreads connections between them, see SocketMultiplexer::CreatePerReactor().
+	ListeningSocket(const Flux::string &bindaddr, short port, bool ipv6, bool reuseport = false);
+	// A UNIX socket, SOCK_STREAM or SOCK_SEQPACKET, at path or in the
+	// abstract namespace with '@'. A stale socket file nobody is listening
+	// on is replaced, the file is removed again with us. Socket is a
+	// virtual base, so the class deriving from this constructs
+	// Socket(-1, AF_UNIX, type) itself, anything else throws.
+	ListeningSocket(const Flux::string &path, int type = SOCK_STREAM);
 	virtual ~ListeningSocket();
 	bool MultiplexRead();
 
+	// With spread the accepted connections are handed out to the reactors in
+	// turn, for when there's only the one listener. OnAccept() is then
+	// called from the other reactors' threads as well and the listener must
+	// outlive the connections it handed off.
+	void SetAcceptBatch(size_t batch, bool spread = false);
+
+	// Wraps a freshly accepted fd, for engines that accept for us.
+	void Accepted(int fd, const sockaddr_t &addr);
+
 	virtual ClientSocket *OnAccept(int fd, const sockaddr_t &addr) = 0;
 };
 
@@ -130,3 +402,115 @@ class ClientSocket : public virtual Socket
 	virtual void OnAccept();
 	virtual void OnError(const Flux::string &str);
 };
+
+// A UDP socket that moves datagrams in batches: one recvmmsg(2) takes up to
+// a batch of them off the socket and one sendmmsg(2) sends everything
+// queued, for when there are so many small packets that a syscall each is
+// most of the cost.
+//
+// With GRO on the kernel glues datagrams from the same sender together,
+// they are cut up again before OnDatagrams() sees them. SendBurst() does
+// the opposite with GSO, the kernel cuts one buffer into equal datagrams.
+//
+// Socket is a virtual base, so a class deriving from this constructs
+// Socket(-1, AF_INET or AF_INET6, SOCK_DGRAM) itself. It can as well be
+// built around a connected SOCK_SEQPACKET fd with an empty bindaddr, sends
+// then leave the address zeroed.
+class DatagramSocket : public virtual Socket
+{
+  public:
+	typedef struct
+	{
+		sockaddr_t	addr; // where it came from, or where it goes
+		const char *data;
+		size_t		len;
+	} datagram_t;
+
+  private:
+	typedef struct
+	{
+		sockaddr_t  addr;
+		std::string data;
+		// Size to cut data into with GSO, 0 for one datagram.
+		uint16_t segment;
+	} pending_t;
+
+	std::mutex sendLock;
+	// All guarded by sendLock.
+	std::deque<pending_t> pending;
+	size_t				  pendingBytes;
+	// In MultiplexRead(), which sends whatever was queued once it's done.
+	bool reading;
+	// WaitWritable() was asked for and MultiplexWrite() hasn't drained the
+	// queue since, so another one would only be a wasted wakeup.
+	bool armed;
+	// 1 once UDP_SEGMENT is known to work, -1 if the kernel won't do it.
+	int					 gso;
+	std::vector<mmsghdr> sendMsgs;
+	std::vector<iovec>	 sendIov;
+	std::vector<char>	 sendControl;
+
+	// Only touched on our reactor, reused for every batch.
+	bool					gro;
+	size_t					batchCount, batchSize;
+	std::vector<char>		recvData, recvControl;
+	std::vector<mmsghdr>	recvMsgs;
+	std::vector<iovec>		recvIov;
+	std::vector<sockaddr_t> recvAddrs;
+	std::vector<datagram_t> received;
+
+	std::atomic<uint64_t> dropped;
+
+	void Queue(const sockaddr_t &to, const void *data, size_t len, uint16_t segment);
+	// Must hold sendLock, true once nothing is left.
+	bool SendQueued();
+	// Must hold sendLock, true if WaitWritable() should be called for wanted.
+	bool Arm(bool wanted);
+	void WaitWritable();
+
+  protected:
+	// 0 for no limit, past it datagrams are dropped like a full socket buffer would.
+	size_t sendHighWater;
+
+  public:
+	// The most the kernel will cut one GSO send into, UDP_MAX_SEGMENTS.
+	static constexpr size_t MaxSegments = 64;
+
+	// An empty bindaddr leaves binding to the kernel, on the first send.
+	// With reuseport several sockets can share the port and the kernel
+	// spreads datagrams between them, see SocketMultiplexer::CreatePerReactor().
+	DatagramSocket(const Flux::string &bindaddr, short port, bool ipv6, bool reuseport = false);
+	virtual ~DatagramSocket();
+
+	// Queue a datagram to go out with everything else queued, from the read
+	// handler once OnDatagrams() returns, otherwise once the reactor next
+	// comes round. Returns false if it was dropped. Any thread.
+	bool SendTo(const sockaddr_t &to, const void *data, size_t len);
+	// Queue several and send them all straight away, returns how many
+	// weren't dropped.
+	size_t SendTo(const datagram_t *datagrams, size_t count);
+	// Send len bytes as datagrams of segment bytes each (the last can be
+	// shorter) to the one address. With GSO that is one trip through the
+	// stack per 64, without it's cut up here and sent like SendTo().
+	bool SendBurst(const sockaddr_t &to, const void *data, size_t len, uint16_t segment);
+	// Send everything queued now.
+	void Flush();
+
+	// How many datagrams come off the socket per recvmmsg() and the most
+	// one can hold. Bigger ones are dropped. Only from our reactor.
+	void SetBatch(size_t count, size_t size);
+	// Ask the kernel for GRO, which needs room for 64k per datagram.
+	// Returns false if it won't do it.
+	bool EnableGRO();
+	void SetHighWater(size_t send);
+	// Datagrams too big to receive or that couldn't be sent.
+	inline uint64_t Dropped() { return this->dropped; }
+
+	bool MultiplexRead();
+	bool MultiplexWrite();
+	bool MultiplexErrorQueue();
+
+	// A batch of datagrams, they are only valid until this returns. Return
+	// false to close the socket.
+	virtual bool OnDatagrams(const datagram_t *datagrams, size_t count) = 0;
+};
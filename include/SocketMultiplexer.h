@@ -24,19 +24,141 @@
 
 #pragma once
 #include "Socket.h"
-#include <list>
+#include "Future.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef enum
+{
+	SE_EPOLL,
+	SE_IOURING
+} socketengine_t;
+
+// The OS specific half of the multiplexer. Engines only deal with the
+// kernel, everything else (the socket table, dispatching to the sockets
+// and reaping them) is SocketMultiplexer's.
+class SocketEngine
+{
+  public:
+	// The reactor this engine belongs to.
+	unsigned reactor = 0;
+
+	virtual ~SocketEngine() {}
+
+	virtual socketengine_t Type() const = 0;
+
+	// These can be called from any thread and must not call back into
+	// SocketMultiplexer. Remove() must be done with the fd before it returns
+	// since the socket closes it right after.
+	virtual bool Add(Socket *s)	= 0;
+	virtual bool Remove(Socket *s) = 0;
+	virtual bool Update(Socket *s) = 0;
+
+	// Wait up to sleep seconds (forever if negative) and hand whatever is
+	// ready to SocketMultiplexer::Dispatch().
+	virtual void Multiplex(time_t sleep) = 0;
+	// Make a Multiplex() that's waiting return, from any thread.
+	virtual void Wake() = 0;
+};
+
+// Engines compiled into this build, these return nullptr if the kernel
+// doesn't support them.
+extern SocketEngine *CreateEpollEngine();
+extern SocketEngine *CreateUringEngine();
+
+// One multiplexer instance. Reactor 0 is run by whoever calls
+// SocketMultiplexer::Multiplex(), the others get a thread each. A socket
+// belongs to the reactor whose thread created it and only that thread
+// runs its handlers.
+class Reactor
+{
+  public:
+	unsigned		  id;
+	SocketEngine *	engine;
+	std::thread		  thread;
+	std::atomic<bool> stop;
+	// Queued by SocketMultiplexer::RunOn()
+	std::mutex				jobLock;
+	std::vector<function_t> jobs;
+
+	Reactor(unsigned id, SocketEngine *engine) : id(id), engine(engine), stop(false) { engine->reactor = id; }
+	~Reactor() { delete this->engine; }
+};
 
 class SocketMultiplexer
 {
   protected:
 	// Used for finding sockets as well as handling other things
-	// like initialization of sockets.
-	static std::list<Socket *> Sockets;
+	// like initialization of sockets. Indexed by fd in chunks that are
+	// allocated as fds get that high and never move, so lookups from the
+	// reactors take no locks.
+	static constexpr size_t				   SocketChunk = 4096, SocketChunks = 1024;
+	static std::atomic<std::atomic<Socket *> *> Sockets[SocketChunks];
+	// Guards allocating chunks and changing reactors.
+	static std::mutex SocketLock;
+
+	static std::vector<std::unique_ptr<Reactor>> Reactors;
+	// The reactor this thread runs, -1 for anything that isn't a reactor
+	// thread. Sockets created from those go to reactor 0. Reactor 0 is
+	// whichever thread called Initialize() or Multiplex().
+	static thread_local int Current;
+	// Sockets to delete once the current batch has been dispatched.
+	static thread_local std::vector<int> Dead;
+
+	static std::atomic<Socket *> *Slot(int sock_fd, bool create);
+	static void					  Start(socketengine_t type, unsigned count);
+	static void					  RunReactor(Reactor *r);
+	static void					  RunJobs(Reactor *r);
+	static void					  StopReactors();
 
   public:
-	// Initalizers
-	static void Initialize();
+	// Initalizers. Falls back to epoll if the engine asked for isn't
+	// available, sockets created before this use the default engine. With
+	// more than one reactor, reactors 1 and up get a thread each.
+	static void Initialize(socketengine_t engine = SE_EPOLL, unsigned reactors = 1);
 	static void Terminate();
+	static socketengine_t EngineType();
+	static unsigned		  ReactorCount();
+
+	// Runs func on the reactor's thread, straight away if we're already on
+	// it. Sockets have to be created on the thread of the reactor they are
+	// meant for, another reactor could see them before they're constructed.
+	// The thread that called Initialize() or Multiplex() counts as reactor
+	// 0's, anything else queues for it.
+	static void RunOn(unsigned reactor, function_t &&func);
+
+	// Makes one T per reactor, for listeners opened with SO_REUSEPORT so the
+	// kernel spreads connections over the reactors. Accepted sockets stay
+	// on the reactor that accepted them. Waits for every reactor to do so,
+	// so call Initialize() first from the thread that runs reactor 0.
+	template<typename T, typename... Args>
+	static std::vector<T *> CreatePerReactor(const Args &... args)
+	{
+		std::vector<Future<T *>> futures;
+		for (unsigned i = 0; i < SocketMultiplexer::ReactorCount(); ++i)
+		{
+			auto promise = std::make_shared<Promise<T *>>();
+			futures.push_back(promise->get_future());
+			SocketMultiplexer::RunOn(i, [promise, args...]() {
+				try
+				{
+					promise->set_value(new T(args...));
+				}
+				catch (...)
+				{
+					promise->set_exception(std::current_exception());
+				}
+			});
+		}
+
+		std::vector<T *> ret;
+		for (auto &f : futures)
+			ret.push_back(f.get());
+		return ret;
+	}
 
 	// Sockets interact with these functions.
 	static bool AddSocket(Socket *s);
@@ -45,5 +167,15 @@ class SocketMultiplexer
 	static bool UpdateSocket(Socket *s);
 
 	// This is called in the event loop to slow the program down and process sockets.
+	// Engines call Socket::NotifyWaiters() for every ready socket so that
+	// coroutines waiting on it get resumed. Only runs reactor 0.
 	static void Multiplex(time_t sleep);
+
+	// Used by the engines. FindSocket() for the reactor's own sockets, an fd
+	// that was closed and reused by another reactor in the meantime isn't ours.
+	static Socket *FindSocket(int sock_fd, unsigned reactor);
+	// Runs the socket's handlers for what it's ready for, sockets that end up
+	// SS_DEAD are deleted by Reap().
+	static void Dispatch(Socket *s, bool readable, bool writable, bool error);
+	static void Reap();
 };
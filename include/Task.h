@@ -0,0 +1,281 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only job objects for the thread engine.
+//
+// std::function has to be copyable and heap allocates anything bigger than
+// a couple of pointers, which adds up when every job is copied through
+// several queues. A Task stores callables of up to InlineSize bytes inside
+// itself and only moves, so a typical lambda costs no allocations at all.
+// Anything bigger comes from a per-thread slab of recycled blocks.
+
+// Per-thread cache of fixed size blocks for oversized captures. Blocks are
+// usually freed by a different thread (the worker that ran the job) so
+// they are sent back to the thread that allocated them through a lock-free
+// stack, keeping both threads allocation free once warmed up.
+class TaskSlab
+{
+  public:
+	// Block sizes we cache, anything bigger goes straight to operator new.
+	static constexpr size_t NumClasses = 5;
+	static constexpr size_t MinBlock = 256;
+	static constexpr size_t MaxBlock = MinBlock << (NumClasses - 1);
+	// Don't hoard more than this many free blocks per size class.
+	static constexpr size_t MaxCached = 256;
+
+	static void *Allocate(size_t size);
+	static void Free(void *ptr);
+
+  private:
+	typedef struct block_s
+	{
+		struct block_s *next;
+		TaskSlab *owner;
+		size_t sizeclass;
+		size_t pad; // keep the payload 16 byte aligned
+	} block_t;
+
+	struct freelist_t
+	{
+		block_t *head;
+		size_t count;
+	};
+
+	freelist_t local[NumClasses];
+	// Blocks freed by other threads, taken over in bulk when local runs dry.
+	std::atomic<block_t *> remote[NumClasses];
+
+	TaskSlab();
+	~TaskSlab();
+
+	static TaskSlab *Current();
+	static block_t *Closed();
+	static void ThreadExit(TaskSlab *slab);
+	void PushRemote(block_t *b);
+
+	friend struct TaskSlabHolder;
+};
+
+class Task
+{
+  public:
+	// Callables up to this size are stored inline.
+	static constexpr size_t InlineSize = 112;
+
+  private:
+	typedef struct
+	{
+		void (*invoke)(void *);
+		void (*move)(void *dst, void *src);
+		void (*destroy)(void *);
+	} taskops_t;
+
+	alignas(std::max_align_t) unsigned char storage[InlineSize];
+	const taskops_t *ops;
+
+	template<typename F>
+	static constexpr bool fits_inline = sizeof(F) <= InlineSize && alignof(F) <= alignof(std::max_align_t) &&
+		std::is_nothrow_move_constructible<F>::value;
+
+	template<typename F>
+	struct InlineOps
+	{
+		static void invoke(void *p) { (*static_cast<F *>(p))(); }
+		static void move(void *dst, void *src)
+		{
+			new (dst) F(std::move(*static_cast<F *>(src)));
+			static_cast<F *>(src)->~F();
+		}
+		static void destroy(void *p) { static_cast<F *>(p)->~F(); }
+		static constexpr taskops_t ops = { invoke, move, destroy };
+	};
+
+	template<typename F>
+	struct HeapOps
+	{
+		static F *get(void *p) { return *static_cast<F **>(p); }
+		static void invoke(void *p) { (*get(p))(); }
+		static void move(void *dst, void *src) { *static_cast<F **>(dst) = get(src); }
+		static void destroy(void *p)
+		{
+			F *f = get(p);
+			f->~F();
+			TaskSlab::Free(f);
+		}
+		static constexpr taskops_t ops = { invoke, move, destroy };
+	};
+
+  public:
+	// When the task was queued, in steady clock nanoseconds. Set by the
+	// thread engine for its wait time counters, it fits in what would
+	// otherwise be padding.
+	uint64_t queued;
+
+	Task() : ops(nullptr), queued(0) {}
+	Task(std::nullptr_t) : ops(nullptr), queued(0) {}
+
+	template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+	Task(F &&func) : queued(0)
+	{
+		typedef typename std::decay<F>::type func_t;
+		if constexpr (fits_inline<func_t>)
+		{
+			new (this->storage) func_t(std::forward<F>(func));
+			this->ops = &InlineOps<func_t>::ops;
+		}
+		else
+		{
+			void *mem = TaskSlab::Allocate(sizeof(func_t));
+			try
+			{
+				*reinterpret_cast<func_t **>(this->storage) = new (mem) func_t(std::forward<F>(func));
+			}
+			catch (...)
+			{
+				TaskSlab::Free(mem);
+				throw;
+			}
+			this->ops = &HeapOps<func_t>::ops;
+		}
+	}
+
+	Task(Task &&other) noexcept : ops(other.ops), queued(other.queued)
+	{
+		if (this->ops)
+		{
+			this->ops->move(this->storage, other.storage);
+			other.ops = nullptr;
+		}
+	}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other)
+		{
+			this->reset();
+			this->queued = other.queued;
+			if ((this->ops = other.ops))
+			{
+				this->ops->move(this->storage, other.storage);
+				other.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+	~Task() { this->reset(); }
+
+	void reset()
+	{
+		if (this->ops)
+		{
+			this->ops->destroy(this->storage);
+			this->ops = nullptr;
+		}
+	}
+
+	explicit operator bool() const { return this->ops != nullptr; }
+	void operator()() { this->ops->invoke(this->storage); }
+};
+
+// A growable ring of Tasks usable as a FIFO queue or a double ended queue.
+// Unlike std::deque it keeps its memory when emptied so a queue that is
+// filled and drained over and over stops allocating.
+class TaskDeque
+{
+	Task *buffer;
+	size_t head;
+	size_t count;
+	size_t mask;
+
+	void Grow()
+	{
+		size_t newcap = this->buffer ? (this->mask + 1) * 2 : 64;
+		Task *newbuf = new Task[newcap];
+		for (size_t i = 0; i < this->count; ++i)
+			newbuf[i] = std::move(this->buffer[(this->head + i) & this->mask]);
+
+		delete[] this->buffer;
+		this->buffer = newbuf;
+		this->head = 0;
+		this->mask = newcap - 1;
+	}
+
+  public:
+	TaskDeque() : buffer(nullptr), head(0), count(0), mask(0) {}
+	~TaskDeque() { delete[] this->buffer; }
+
+	TaskDeque(TaskDeque &&other) noexcept : buffer(other.buffer), head(other.head), count(other.count), mask(other.mask)
+	{
+		other.buffer = nullptr;
+		other.head = other.count = other.mask = 0;
+	}
+
+	TaskDeque(const TaskDeque &) = delete;
+	TaskDeque &operator=(const TaskDeque &) = delete;
+
+	inline size_t size() const { return this->count; }
+	inline bool empty() const { return this->count == 0; }
+
+	void push_back(Task &&t)
+	{
+		if (!this->buffer || this->count == this->mask + 1)
+			this->Grow();
+		this->buffer[(this->head + this->count++) & this->mask] = std::move(t);
+	}
+
+	inline Task &front() { return this->buffer[this->head]; }
+	inline Task &back() { return this->buffer[(this->head + this->count - 1) & this->mask]; }
+
+	void pop_front()
+	{
+		this->buffer[this->head].reset();
+		this->head = (this->head + 1) & this->mask;
+		this->count--;
+	}
+
+	void pop_back()
+	{
+		this->back().reset();
+		this->count--;
+	}
+
+	void clear()
+	{
+		while (!this->empty())
+			this->pop_front();
+	}
+};
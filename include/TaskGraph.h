@@ -0,0 +1,127 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include "ThreadEngine.h"
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Runs a set of jobs with dependencies between them on a ThreadHandler.
+//
+// Declare the jobs with Add(), say which must finish before which with
+// Precede(), then Run() the graph. Every job is queued the moment its last
+// predecessor finishes so independent chains run side by side. Afterwards
+// the per-job timings and the critical path show where the time went, eg.
+//
+//   TaskGraph g(pool);
+//   auto cfg = g.Add("config", [] { ... });
+//   auto mods = g.Add("modules", [] { ... });
+//   auto listen = g.Add("listeners", [] { ... });
+//   g.Precede(cfg, mods);
+//   g.Precede(mods, listen);
+//   g.Run();
+//   printf("%s", g.Report().c_str());
+class TaskGraph
+{
+  public:
+	typedef size_t node_t;
+
+	// What happened to one job during the last Run()
+	typedef struct
+	{
+		// Relative to the start of Run()
+		std::chrono::nanoseconds start;
+		std::chrono::nanoseconds duration;
+		// ThreadHandler::GetThreadID() of the thread that ran it
+		int thread;
+		// False if it was skipped because a predecessor threw
+		bool ran;
+	} nodetiming_t;
+
+  private:
+	typedef struct
+	{
+		std::string name;
+		function_t func;
+		std::vector<node_t> successors;
+		size_t predecessors;
+		nodetiming_t timing;
+	} graphnode_t;
+
+	ThreadHandler &pool;
+	std::vector<graphnode_t> nodes;
+
+	// State for the current Run()
+	std::unique_ptr<std::atomic<size_t>[]> waiting;
+	std::unique_ptr<std::atomic<bool>[]> skipped;
+	std::atomic<size_t> pending;
+	std::chrono::steady_clock::time_point started;
+	std::chrono::nanoseconds elapsed;
+	std::exception_ptr error;
+	std::mutex errorLock;
+
+	// Run a job and then whatever became ready because of it
+	void Execute(node_t n);
+	// Nodes in an order where every job comes after its predecessors,
+	// throws if the graph has a cycle.
+	std::vector<node_t> TopologicalOrder() const;
+
+  public:
+	TaskGraph(ThreadHandler &pool);
+
+	// Add a job to the graph, the name is only used for reporting.
+	template<typename F>
+	node_t Add(const std::string &name, F &&func)
+	{
+		this->nodes.push_back(graphnode_t{ name, function_t(std::forward<F>(func)), {}, 0, {} });
+		return this->nodes.size() - 1;
+	}
+
+	// before must finish before after may start
+	void Precede(node_t before, node_t after);
+
+	// Run every job and wait for them, helping the pool out meanwhile.
+	// Rethrows the first exception a job threw, jobs which depend on a
+	// failed job are not run. The graph can be run again afterwards but
+	// not from two threads at once.
+	void Run();
+
+	inline size_t Size() const { return this->nodes.size(); }
+	inline const std::string &Name(node_t n) const { return this->nodes[n].name; }
+	inline const nodetiming_t &Timing(node_t n) const { return this->nodes[n].timing; }
+	// Wall clock time the last Run() took
+	inline std::chrono::nanoseconds Elapsed() const { return this->elapsed; }
+
+	// The chain of dependent jobs which took the longest in the last Run(),
+	// this is as fast as the graph can go however many threads there are.
+	// Returns its length and fills path with its jobs in order.
+	std::chrono::nanoseconds CriticalPath(std::vector<node_t> *path = nullptr) const;
+
+	// A human readable table of the timings and the critical path
+	std::string Report() const;
+};
@@ -15,38 +15,179 @@
 
 #pragma once
 #include <functional>
-#include <queue>
 #include <thread>
 #include <mutex>
 #include <atomic>
-#include <list>
+#include <chrono>
+#include <vector>
+#include <memory>
 #include <condition_variable>
+#include <array>
+#include "nlohmann/json_fwd.hpp"
+#include "MPMCQueue.h"
+#include "Task.h"
 
-typedef std::queue < std::function < void () >> functions_t;
-typedef std::function<void ()> function_t;
+typedef TaskDeque functions_t;
+typedef Task function_t;
+typedef MPMCQueue<function_t> jobqueue_t;
+
+// How jobs are handed out to the worker threads.
+typedef enum
+{
+	// Every job goes through the global queues (ThreadHandler::funcs)
+	TS_GLOBALQUEUE,
+	// Each worker owns a deque of jobs and idle workers steal from the others
+	TS_WORKSTEALING
+} threadsched_t;
+
+// Where the workers are allowed to run, set ThreadHandler::affinity
+// before Initialize(). When pinned the workers are split evenly between
+// the NUMA nodes and each node gets its own sub-pool.
+typedef enum
+{
+	// Let the OS place the workers anywhere
+	TA_NONE,
+	// Pin each worker to every CPU of its NUMA node
+	TA_NODE,
+	// Pin each worker to a single CPU of its NUMA node
+	TA_CORE
+} threadaffinity_t;
+
+// How urgent a job is, lower values run first. Only normal jobs go through
+// the workers' deques when work stealing, the other classes always use
+// their global queue so every worker sees them.
+typedef enum
+{
+	// Latency sensitive work such as socket handlers
+	TP_REALTIME,
+	// Anything submitted without a priority
+	TP_NORMAL,
+	// Bulk work which runs when nothing more urgent is waiting
+	TP_BACKGROUND,
+	TP_MAX
+} taskpriority_t;
+
+// What Submit() does when ThreadHandler::pendingLimit jobs are already
+// waiting, so an overloaded pool slows or sheds producers instead of
+// queueing without bound.
+typedef enum
+{
+	// Help run jobs on the calling thread until there is room
+	QP_BLOCK,
+	// Return false, the jobs which didn't fit are left with the caller
+	QP_FAIL,
+	// Run the jobs which don't fit on the calling thread
+	QP_INLINE
+} queuepolicy_t;
+
+// Scheduling counters for one priority class, see ThreadHandler::Stats()
+typedef struct
+{
+	// Jobs waiting to run right now
+	size_t depth;
+	// Jobs queued and started since the pool was created
+	uint64_t queued;
+	uint64_t run;
+	// Time between a job being queued and starting, in nanoseconds
+	uint64_t waitTotal;
+	uint64_t waitMax;
+	// Jobs which started after their deadline had passed
+	uint64_t deadlineMisses;
+	// Jobs turned away or run by the submitter because the pool was full
+	uint64_t rejected;
+	uint64_t inlined;
+} schedstats_t;
+
+// Buckets in the per-worker wait time histogram, bucket i counts jobs
+// which waited less than 2^i microseconds and the last one the rest.
+static constexpr size_t WaitHistogramBuckets = 24;
+
+// A snapshot of one worker's counters, see ThreadHandler::Telemetry()
+typedef struct
+{
+	int threadID;
+	unsigned int node;
+	bool running;
+	uint64_t jobsRun;
+	// Jobs taken from another worker's deque
+	uint64_t steals;
+	// Time spent running jobs, parked, and looking for jobs (including spinning)
+	std::chrono::nanoseconds busy;
+	std::chrono::nanoseconds idle;
+	std::chrono::nanoseconds searching;
+	std::chrono::nanoseconds longestJob;
+	std::array<uint64_t, WaitHistogramBuckets> waitHistogram;
+} workerstats_t;
 
 class ThreadHandler;
+template<typename T> class Future;
 
 class WorkerThread
 {
-	// Mutex used for sleeping the thread
+	// Set by whoever wakes us, the parked thread waits on it with a futex
+	std::atomic<uint32_t> wakeToken;
+#ifndef __linux__
+	// Mutex used for sleeping the thread where we have no futex
 	std::mutex m;
 	std::condition_variable cv;
-	bool wakeThread;
+#endif
 	std::thread th; // Inherit std::thread instead?
 	ThreadHandler *thr;
+
+	// Jobs owned by this worker when work stealing is enabled. The owner
+	// pushes and pops at the back while thieves take from the front so
+	// the two ends rarely fight over the same job.
+	functions_t jobs;
+	std::mutex jobLock;
 protected:
 	// Thread ID
 	int threadID;
+
+	// Our position in ThreadHandler::Threads
+	size_t index;
+
+	// The NUMA node and CPU we were placed on, see ThreadHandler::affinity
+	unsigned int node;
+	int cpu;
+	// Apply the placement to the calling thread
+	void Pin();
+
+	// Owner end of the job deque
+	bool PushJobs(functions_t &q, size_t count, bool tryOnly = false);
+	bool PopJob(function_t &func);
+	// Thief end of the job deque
+	bool StealJob(function_t &func);
+	// Find a job in our own deque or steal one from another worker, trying
+	// the workers on our own node before the rest.
+	bool FindJob(function_t &func);
+	// Leave the pool after idling, returns false if we're still needed
+	bool Retire();
+
+	// Jobs run by this worker, only ever written by the worker itself
+	std::atomic<uint64_t> jobsRun;
+
+	// Telemetry, also only written by the worker itself so updating it is
+	// a plain load and store. Times are in nanoseconds.
+	std::atomic<uint64_t> steals, busyTime, idleTime, searchTime, longestJob;
+	std::atomic<uint64_t> waitHistogram[WaitHistogramBuckets];
+	static inline void Count(std::atomic<uint64_t> &counter, uint64_t n = 1)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	void RecordWait(uint64_t ns);
 public:
 	WorkerThread(int, ThreadHandler*);
 	~WorkerThread();
 
 	friend class ThreadHandler;
 
-	// Put the thread into an idle state
-	void Sleep();
-	// Wake the thread from idle state
+	// Start executing jobs, called once all workers are constructed.
+	void Start();
+	// Put the thread into an idle state, returns false if nothing woke
+	// us before the pool's idle timeout
+	bool Sleep();
+	// Wake the thread from idle state, only ThreadHandler should call this
+	// (see ThreadHandler::WakeThreads) so the idle stack stays correct.
 	void Wake();
 	// Execute jobs - This is called by the Job Handler directly.
 	void Main();
@@ -64,8 +205,93 @@ class ThreadHandler
 {
 protected:
 	void JoinThreads();
-	void WakeThreads();
-	std::list<WorkerThread*> Threads;
+	// Wake up to count parked workers, one for each new job. Workers on
+	// node are preferred if one is given.
+	void WakeThreads(size_t count, int node = -1);
+	// Wake every parked worker
+	void WakeAllThreads();
+
+	// Parked workers, most recently parked on top so we wake the worker
+	// with the warmest cache and the rest can time out and retire.
+	std::mutex idleLock;
+	std::vector<WorkerThread*> idleStack;
+	void ParkWorker(WorkerThread *t);
+	// Returns false if a waker already took t off the stack
+	bool UnparkWorker(WorkerThread *t);
+	// Every worker slot, only the first activeThreads are running. Slots are
+	// handed out to the NUMA nodes in turn so worker i is on node i % nodes
+	// and retiring from the top keeps the nodes balanced.
+	std::vector<WorkerThread*> Threads;
+
+	// CPUs we may use on each NUMA node, a single node unless pinned
+	std::vector<std::vector<int>> nodeCPUs;
+	// Normal jobs submitted with a node hint, one queue per node. Only
+	// created when there is more than one node.
+	std::vector<std::unique_ptr<jobqueue_t>> nodeFuncs;
+	// A running worker on node to give jobs to, nullptr if there are none
+	WorkerThread *PickWorker(int node, size_t nthreads);
+	// Take a normal job from the shared queues, our node's and the global
+	// one first or, if remote, the other nodes' queues.
+	bool PopShared(unsigned int node, bool remote, function_t &func);
+	// Which worker Submit() starts spreading the next batch at
+	std::atomic<unsigned int> nextWorker;
+
+	// Jobs queued and not yet started, checked against pendingLimit
+	std::atomic<size_t> queuedJobs;
+	// Claim room for up to count jobs, returns how many we got
+	size_t Reserve(size_t count);
+	bool SubmitBatch(functions_t &pending, taskpriority_t priority, int node, queuepolicy_t policy);
+	// Hand the first count jobs of pending, already reserved, to the workers
+	void Publish(functions_t &pending, size_t count, taskpriority_t priority, int node, bool noStall);
+
+	// Jobs with a deadline, a min-heap on the deadline for each class
+	typedef struct
+	{
+		std::chrono::steady_clock::time_point deadline;
+		function_t func;
+	} deadlinejob_t;
+	std::mutex deadlineLock;
+	std::vector<deadlinejob_t> deadlines[TP_MAX];
+	std::atomic<size_t> deadlineCount;
+	// Take the earliest job due before the given time, from one class or
+	// from any if priority is negative. priority is set to the job's class.
+	bool PopDeadline(function_t &func, int &priority, std::chrono::steady_clock::time_point before);
+
+	// Per class counters, padded so the classes don't share cache lines
+	struct alignas(64) schedcounters_t
+	{
+		std::atomic<uint64_t> queued, run, waitTotal, waitMax, deadlineMisses, rejected, inlined;
+		// Last time this class had nothing waiting or had a job started
+		std::atomic<int64_t> lastServed;
+	};
+	schedcounters_t counters[TP_MAX];
+
+	// Pick the next job to run: urgent deadlines first, then each class in
+	// priority order except that a class which has waited longer than
+	// starvationLimit goes first. self is the calling worker, if any.
+	bool NextJob(WorkerThread *self, function_t &func);
+	bool PopClass(WorkerThread *self, int priority, function_t &func);
+
+	// Adaptive pool sizing, the monitor thread grows the pool when jobs
+	// wait too long and idle workers retire themselves.
+	void Monitor();
+	std::thread monitor;
+	std::mutex poolLock;
+	std::condition_variable monitorCV;
+	std::atomic<unsigned int> activeThreads;
+	std::atomic<unsigned int> idleThreads;
+	std::atomic<unsigned int> blockedThreads;
+	bool monitorQuitting;
+
+	// Jobs waiting for their time to come, a min-heap on the time. Guarded
+	// by poolLock, the monitor hands them to the workers when they're due.
+	typedef struct
+	{
+		std::chrono::steady_clock::time_point when;
+		taskpriority_t priority;
+		function_t func;
+	} timedjob_t;
+	std::vector<timedjob_t> timedJobs;
 public:
 	ThreadHandler();
 	~ThreadHandler();
@@ -73,12 +299,39 @@ public:
 	// Let the threads access members in this class
 	friend class WorkerThread;
 
-	// Waiting jobs, This is global among all threads.
-	functions_t funcs;
+	// Waiting jobs for each priority class, This is global among all threads.
+	jobqueue_t funcs[TP_MAX];
 
 	// Defines how many threads the system is designed to use
 	unsigned int totalConcurrentThreads;
 
+	// How jobs are distributed to the workers, set by Initialize()
+	threadsched_t schedMode;
+
+	// Whether workers are pinned to CPUs, set before Initialize()
+	threadaffinity_t affinity;
+
+	// Pool size bounds, set these before Initialize(). Zero means one
+	// thread per usable CPU for the minimum and twice that for the maximum.
+	unsigned int minThreads;
+	unsigned int maxThreads;
+	// How long a worker may sit idle before it retires
+	std::chrono::milliseconds idleTimeout;
+	// Grow the pool when jobs are expected to wait longer than this
+	std::chrono::milliseconds targetLatency;
+	// Slots in each global job queue, set before Initialize()
+	size_t queueCapacity;
+	// Most jobs that may be waiting before Submit() applies queuePolicy,
+	// zero for no limit. Enqueue() is always let through since it carries
+	// continuations and such which the waiting jobs may depend on.
+	size_t pendingLimit;
+	queuepolicy_t queuePolicy;
+	// A lower priority class which has not had a job started for this long
+	// gets the next free worker ahead of the higher classes.
+	std::chrono::milliseconds starvationLimit;
+	// Jobs this close to their deadline run before anything else
+	std::chrono::milliseconds deadlineSlack;
+
 	// This makes it easy to specify functions and arguments
 	// in a readable manner
 	template< class _Function, class... _Args >
@@ -88,22 +341,97 @@ public:
 		// This is what allows us to submit functions asynchronously
 		// then submit them to the global job queue
 
-		// Make a bound std::function for storage
-		function_t func = std::bind(std::forward<_Function>(__f), std::forward<_Args>(__args)...);
+		// Bind the arguments into a move-only task, small enough callables
+		// are stored inside the task itself so nothing is allocated.
+		function_t func;
+		if constexpr (sizeof...(_Args) == 0)
+			func = function_t(std::forward<_Function>(__f));
+		else
+			func = function_t([__f = std::forward<_Function>(__f), ...__args = std::forward<_Args>(__args)]() mutable {
+				std::invoke(__f, __args...);
+			});
+
+		// The wait time counters start from here
+		func.queued = Now();
+
 		// Push to thread local storage container
 #ifndef _WIN32
 		extern thread_local functions_t threadQueue;
-		threadQueue.push(func);
+		threadQueue.push_back(std::move(func));
 #else
 		extern __declspec(thread) functions_t* threadQueue;
-		threadQueue->push(func);
+		threadQueue->push_back(std::move(func));
 #endif
 	}
 
-	bool Submit(bool noStall = false);
+	// Hand the jobs added with AddQueue() on this thread to the workers.
+	// Normal jobs can be given a NUMA node to run on, see NumaNodes().
+	// noStall fails instead of blocking when the pool is full, whatever
+	// queuePolicy says. Returns false if jobs were left behind.
+	bool Submit(bool noStall = false, taskpriority_t priority = TP_NORMAL, int node = -1);
+	// Same for a batch the caller built. Room for the whole batch is
+	// claimed with a single atomic operation and it is published with one
+	// CAS on the global queue or one lock per receiving worker. Whatever
+	// QP_FAIL turns away is left in jobs.
+	bool SubmitBatch(functions_t &jobs, taskpriority_t priority = TP_NORMAL, int node = -1);
 
-	void Initialize();
+	// Hand a single job straight to the workers, bypassing the thread
+	// local queue. Used for continuations which must not wait for the
+	// thread that completed their input to call Submit().
+	void Enqueue(function_t &&func, taskpriority_t priority = TP_NORMAL, int node = -1);
+	// Same, but the job runs ahead of the other jobs in its class in
+	// deadline order, and ahead of every class once within deadlineSlack.
+	void Enqueue(function_t &&func, std::chrono::steady_clock::time_point deadline, taskpriority_t priority = TP_NORMAL);
+
+	// Queue a job once delay has passed. The pool monitor does the timing,
+	// so it may start up to a millisecond or so late.
+	void EnqueueAfter(function_t &&func, std::chrono::steady_clock::duration delay, taskpriority_t priority = TP_NORMAL);
+
+	// Run one waiting job on the calling thread, if there is one. Lets a
+	// thread that is waiting on other jobs help out instead of sleeping.
+	bool TryRunJob();
+
+	// Run a callable on the pool and get a Future for its result.
+	// Defined in Future.h, include that to use it.
+	template< class _Function, class... _Args >
+	auto Async(_Function&& __f, _Args&&... __args);
+
+	void Initialize(threadsched_t mode = TS_GLOBALQUEUE);
 	void Shutdown();
 
+	// Number of jobs waiting to be run by the workers
+	size_t PendingJobs();
+	// Queue depth and wait times for a priority class
+	schedstats_t Stats(taskpriority_t priority);
+	// Counters of every worker slot, running or not
+	std::vector<workerstats_t> Telemetry();
+	// Everything above plus the pool size as JSON, for dumping to logs or
+	// serving from a status endpoint.
+	nlohmann::json TelemetryJSON();
+	// Number of worker threads currently running
+	inline unsigned int ActiveThreads() const { return this->activeThreads; }
+	// Number of NUMA node sub-pools, valid node hints are 0 to this - 1
+	inline unsigned int NumaNodes() const { return this->nodeCPUs.size(); }
+
+	// Mark the calling job as about to block (eg. on disk or network I/O)
+	// so the pool can start another worker to keep the CPUs busy.
+	void BeginBlocking();
+	void EndBlocking();
+
 	static int GetThreadID();
+	// Steady clock in nanoseconds, the time base for Task::queued
+	static inline uint64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+};
+
+// Marks a scope as blocking for the adaptive pool, eg.
+// { BlockingRegion br(pool); read(fd, buf, len); }
+class BlockingRegion
+{
+	ThreadHandler &thr;
+public:
+	BlockingRegion(ThreadHandler &thr) : thr(thr) { thr.BeginBlocking(); }
+	~BlockingRegion() { thr.EndBlocking(); }
 };
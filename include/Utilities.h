@@ -164,7 +164,7 @@ class Flags
 	void RemoveFlags(Args... values)
 	{
 		// C++ 17 fold expression
-		(this->SetFlag(values), ...);
+		(this->RemoveFlag(values), ...);
 	}
 
 	/** Check if this item has a flag
@@ -0,0 +1,353 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "ConnectionPool.h"
+#include "Exceptions.h"
+#include "Log.h"
+#include <algorithm>
+#include <optional>
+#include <sys/socket.h>
+
+PooledSocket::PooledSocket(bool ipv6) : Socket(-1, ipv6), ConnectionSocket(ipv6), pool(nullptr), idle(false), connecting(false), idleSince(0) {}
+
+PooledSocket::~PooledSocket()
+{
+	if (this->pool)
+		this->pool->Closed(this);
+}
+
+bool PooledSocket::MultiplexEvent()
+{
+	// An idle connection has nothing to say, if the peer closed it or sent
+	// something anyway it's no use for another request.
+	if (this->idle)
+	{
+		if (!this->Healthy())
+			this->SetFlag(SS_DEAD);
+		return false;
+	}
+
+	return ConnectionSocket::MultiplexEvent();
+}
+
+bool PooledSocket::Healthy()
+{
+	if (this->HasFlag(SS_DEAD) || !this->HasFlag(SS_CONNECTED) || this->Buffered())
+		return false;
+
+	// Buffered() only knows what io_uring read for us, mixed in with a
+	// BufferedSocket there's its rings too. Unsent data would go out in the
+	// middle of the next request.
+	BufferedSocket *bs = dynamic_cast<BufferedSocket *>(this);
+	if (bs && (bs->ReadQueued() || bs->WriteQueued()))
+		return false;
+
+	char	c;
+	ssize_t len = ::recv(this->sock_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void PooledSocket::OnConnect()
+{
+	if (this->pool)
+		this->pool->Connected(this);
+}
+
+void PooledSocket::OnError(const Flux::string &str)
+{
+	if (this->pool)
+		this->pool->Failed(this->key, this, str);
+}
+
+ConnectionPool::ConnectionPool(size_t maxPerHost, size_t maxIdle, time_t idleTimeout)
+	: Timer(1, true), maxPerHost(std::max<size_t>(maxPerHost, 1)), maxIdle(maxIdle), idleTimeout(idleTimeout)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+	std::vector<Promise<PooledSocket *>> waiters;
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+		for (auto &it : this->hosts)
+		{
+			for (auto s : it.second.idle)
+				this->Close(s);
+			for (auto s : it.second.sockets)
+				s->pool = nullptr;
+			for (auto &p : it.second.waiters)
+				waiters.push_back(std::move(p));
+		}
+		this->hosts.clear();
+	}
+
+	for (auto &p : waiters)
+		p.set_exception(std::make_exception_ptr(SocketException("Connection pool deleted")));
+}
+
+// The multiplexer gets the hangup and reaps it like any other dead socket,
+// it could be in the middle of running it on another reactor.
+void ConnectionPool::Close(PooledSocket *s)
+{
+	s->idle = true;
+	::shutdown(s->GetFD(), SHUT_RDWR);
+}
+
+// Open connections for whoever is waiting that no connection is on its way for.
+size_t ConnectionPool::Refill(host_t &h)
+{
+	size_t count = 0;
+	while (h.waiters.size() > h.connecting && h.total < this->maxPerHost)
+	{
+		h.total++;
+		h.connecting++;
+		count++;
+	}
+	return count;
+}
+
+void ConnectionPool::Open(const std::string &key, const Flux::string &address, short port, size_t count)
+{
+	while (count--)
+	{
+		PooledSocket *s = nullptr;
+		try
+		{
+			s = this->OnCreate(address, port);
+			if (!s)
+				throw SocketException("ConnectionPool::OnCreate() returned nullptr");
+
+			{
+				std::lock_guard<std::mutex> lk(this->lock);
+				s->pool		  = this;
+				s->key		  = key;
+				s->connecting = true;
+				this->hosts[key].sockets.push_back(s);
+			}
+
+			// Either of OnConnect() or OnError() can happen before this returns.
+			s->Connect(address, port);
+		}
+		catch (const std::exception &ex)
+		{
+			this->Failed(key, s, ex.what());
+			delete s;
+		}
+	}
+}
+
+void ConnectionPool::Connected(PooledSocket *s)
+{
+	std::optional<Promise<PooledSocket *>> waiter;
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+		host_t &					h = this->hosts[s->key];
+		if (s->connecting)
+		{
+			s->connecting = false;
+			h.connecting--;
+		}
+
+		if (!h.waiters.empty())
+		{
+			waiter.emplace(std::move(h.waiters.front()));
+			h.waiters.pop_front();
+		}
+		else if (h.idle.size() < this->maxIdle)
+		{
+			// Whoever asked for it got another one, keep it for the next.
+			s->idle		 = true;
+			s->idleSince = time(NULL);
+			h.idle.push_back(s);
+		}
+		else
+			this->Close(s);
+	}
+
+	if (waiter)
+		waiter->set_value(s);
+}
+
+void ConnectionPool::Failed(const std::string &key, PooledSocket *s, const Flux::string &error)
+{
+	std::vector<Promise<PooledSocket *>> waiters;
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+		// Errors after it connected are the owner's business.
+		if (s && !s->connecting)
+			return;
+
+		host_t &h = this->hosts[key];
+		h.connecting--;
+		if (s)
+		{
+			s->connecting = false;
+			s->idle		  = true;
+		}
+		else
+			// Never made it as far as a socket.
+			h.total--;
+
+		// Fail whoever there's no other connection on its way for, longest
+		// waiting first.
+		while (h.waiters.size() > h.connecting)
+		{
+			waiters.push_back(std::move(h.waiters.front()));
+			h.waiters.pop_front();
+		}
+	}
+
+	"[Connection Pool] Unable to connect to {}: {}"_lw(key, error);
+
+	// Reaped with the rest of the dead sockets, or after the hangup it gets
+	// if connect() failed straight away.
+	if (s)
+		s->SetFlag(SS_DEAD);
+
+	for (auto &p : waiters)
+		p.set_exception(std::make_exception_ptr(SocketException(error)));
+}
+
+void ConnectionPool::Closed(PooledSocket *s)
+{
+	Flux::string address;
+	short		 port  = 0;
+	size_t		 count = 0;
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+		auto						it = this->hosts.find(s->key);
+		if (it == this->hosts.end())
+			return;
+
+		host_t &h = it->second;
+		h.total--;
+		if (s->connecting)
+			h.connecting--;
+		h.sockets.erase(std::find(h.sockets.begin(), h.sockets.end(), s));
+		auto idle = std::find(h.idle.begin(), h.idle.end(), s);
+		if (idle != h.idle.end())
+			h.idle.erase(idle);
+
+		// A connection that died while everything was in use frees a slot
+		// for whoever is waiting.
+		count	= this->Refill(h);
+		address = h.address;
+		port	= h.port;
+	}
+
+	this->Open(s->key, address, port, count);
+}
+
+Future<PooledSocket *> ConnectionPool::Acquire(const Flux::string &address, short port)
+{
+	Promise<PooledSocket *> promise;
+	Future<PooledSocket *>	future = promise.get_future();
+	std::string				key	= address.c_str() + std::string("/") + std::to_string(port);
+	PooledSocket *			s	  = nullptr;
+	size_t					count  = 0;
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+		host_t &					h = this->hosts[key];
+		h.address					  = address;
+		h.port						  = port;
+
+		// Most recently used first, its congestion window is the warmest and
+		// the ones at the front get to time out.
+		while (!s && !h.idle.empty())
+		{
+			s = h.idle.back();
+			h.idle.pop_back();
+			if (s->Healthy())
+				s->idle = false;
+			else
+			{
+				this->Close(s);
+				s = nullptr;
+			}
+		}
+
+		if (!s)
+		{
+			h.waiters.push_back(std::move(promise));
+			count = this->Refill(h);
+		}
+	}
+
+	if (s)
+		promise.set_value(s);
+	else
+		this->Open(key, address, port, count);
+	return future;
+}
+
+void ConnectionPool::Release(PooledSocket *s, bool reuse)
+{
+	if (s->pool != this)
+		return;
+
+	std::optional<Promise<PooledSocket *>> waiter;
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+		host_t &					h = this->hosts[s->key];
+		if (!reuse || !s->Healthy())
+			this->Close(s);
+		else if (!h.waiters.empty())
+		{
+			waiter.emplace(std::move(h.waiters.front()));
+			h.waiters.pop_front();
+		}
+		else if (h.idle.size() < this->maxIdle)
+		{
+			s->idle		 = true;
+			s->idleSince = time(NULL);
+			h.idle.push_back(s);
+		}
+		else
+			this->Close(s);
+	}
+
+	if (waiter)
+		waiter->set_value(s);
+}
+
+void ConnectionPool::Tick(time_t now)
+{
+	std::lock_guard<std::mutex> lk(this->lock);
+	for (auto it = this->hosts.begin(); it != this->hosts.end();)
+	{
+		host_t &h = it->second;
+		// Oldest at the front.
+		while (!h.idle.empty() && h.idle.front()->idleSince + this->idleTimeout <= now)
+		{
+			this->Close(h.idle.front());
+			h.idle.pop_front();
+		}
+
+		// Forget about destinations we have nothing to do with anymore.
+		if (!h.total && h.waiters.empty())
+			it = this->hosts.erase(it);
+		else
+			++it;
+	}
+}
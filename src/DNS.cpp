@@ -0,0 +1,793 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "DNS.h"
+#include "Exceptions.h"
+#include "Log.h"
+#include "SocketMultiplexer.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+std::mutex													DNSResolver::Lock;
+bool														DNSResolver::Configured = false;
+sockaddr_t													DNSResolver::Nameserver;
+DNSSocket *													DNSResolver::Sock  = nullptr;
+TimerSocket *												DNSResolver::Retry = nullptr;
+std::unordered_map<std::string, DNSResolver::cacheentry_t>	DNSResolver::Cache;
+std::unordered_map<std::string, DNSResolver::query_t>		DNSResolver::Queries;
+std::unordered_map<uint16_t, std::string>					DNSResolver::IDs;
+std::unordered_multimap<std::string, sockaddr_t>			DNSResolver::Hosts;
+
+// Answers we'd hold on to for longer than this we don't.
+static constexpr uint32_t MaxTTL = 86400;
+
+static bool ParseAddress(const std::string &str, sockaddr_t &addr)
+{
+	memset(&addr, 0, sizeof(sockaddr_t));
+	if (inet_pton(AF_INET, str.c_str(), &addr.ipv4.sin_addr) == 1)
+		addr.ipv4.sin_family = AF_INET;
+	else if (inet_pton(AF_INET6, str.c_str(), &addr.ipv6.sin6_addr) == 1)
+		addr.ipv6.sin6_family = AF_INET6;
+	else
+		return false;
+	return true;
+}
+
+static void SetPort(sockaddr_t &addr, short port)
+{
+	if (addr.sa.sa_family == AF_INET6)
+		addr.ipv6.sin6_port = htons(port);
+	else
+		addr.ipv4.sin_port = htons(port);
+}
+
+static std::string Lower(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return tolower(c); });
+	if (!str.empty() && str.back() == '.')
+		str.pop_back();
+	return str;
+}
+
+static uint16_t Get16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+static uint32_t Get32(const unsigned char *p) { return static_cast<uint32_t>(Get16(p)) << 16 | Get16(p + 2); }
+
+// Step over a possibly compressed name, returns 0 if it runs off the end.
+static size_t SkipName(const unsigned char *packet, size_t len, size_t off)
+{
+	while (off < len)
+	{
+		if (!packet[off])
+			return off + 1;
+		// A pointer ends the name.
+		if ((packet[off] & 0xC0) == 0xC0)
+			return off + 2 <= len ? off + 2 : 0;
+		off += packet[off] + 1;
+	}
+	return 0;
+}
+
+// The UDP socket queries go out on, connected to the nameserver so the
+// kernel drops anything that didn't come from it.
+class DNSSocket : public Socket
+{
+  public:
+	DNSSocket(const sockaddr_t &ns) : Socket(-1, ns.sa.sa_family, SOCK_DGRAM)
+	{
+		if (::connect(this->sock_fd, &ns.sa, ns.sa.sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in)) == -1)
+			"[DNS] Unable to connect to the nameserver: {}"_lw(strerror(errno));
+
+		this->RemoveFlag(MX_WRITABLE);
+		SocketMultiplexer::UpdateSocket(this);
+	}
+
+	~DNSSocket()
+	{
+		std::vector<Promise<DNSResolver::result_t>> waiters;
+		{
+			std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+			if (DNSResolver::Sock != this)
+				return;
+			DNSResolver::Sock = nullptr;
+			waiters			  = DNSResolver::Abandon();
+		}
+		DNSResolver::Fail(waiters, "Resolver shut down");
+	}
+
+	bool MultiplexRead()
+	{
+		unsigned char packet[4096];
+		for (;;)
+		{
+			ssize_t len = ::recv(this->sock_fd, packet, sizeof(packet), 0);
+			if (len > 0)
+				DNSResolver::Received(packet, len);
+			else if (len == -1 && errno == EINTR)
+				continue;
+			else if (len == -1 && errno == ECONNREFUSED)
+				this->Refused();
+			else
+				break;
+		}
+		return true;
+	}
+
+	// An ICMP port unreachable, nothing is listening there.
+	void Refused()
+	{
+		std::vector<Promise<DNSResolver::result_t>> waiters;
+		{
+			std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+			waiters = DNSResolver::Abandon();
+		}
+		DNSResolver::Fail(waiters, "Nameserver refused the connection");
+	}
+
+	bool MultiplexErrorQueue()
+	{
+		int		  optval = 0;
+		socklen_t optlen = sizeof(int);
+		getsockopt(this->sock_fd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+		if (optval == ECONNREFUSED)
+			this->Refused();
+		// Nothing on a UDP socket is fatal, keep going.
+		return true;
+	}
+};
+
+class DNSRetryTimer : public TimerSocket
+{
+  public:
+	DNSRetryTimer() : TimerSocket(DNSResolver::Timeout / 4, DNSResolver::Timeout / 4) {}
+
+	~DNSRetryTimer()
+	{
+		std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+		if (DNSResolver::Retry == this)
+			DNSResolver::Retry = nullptr;
+	}
+
+	void Tick() { DNSResolver::Tick(); }
+};
+
+void DNSResolver::LoadConfig()
+{
+	if (DNSResolver::Configured)
+		return;
+	DNSResolver::Configured = true;
+
+	if (!DNSResolver::Nameserver.sa.sa_family)
+	{
+		ParseAddress("127.0.0.1", DNSResolver::Nameserver);
+		std::ifstream resolv("/etc/resolv.conf");
+		for (std::string line; std::getline(resolv, line);)
+		{
+			std::istringstream words(line);
+			std::string		   key, value;
+			if (words >> key >> value && key == "nameserver" && ParseAddress(value, DNSResolver::Nameserver))
+				break;
+		}
+		SetPort(DNSResolver::Nameserver, 53);
+	}
+
+	std::ifstream hosts("/etc/hosts");
+	for (std::string line; std::getline(hosts, line);)
+	{
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::string		   address, name;
+		sockaddr_t		   addr;
+		if (!(words >> address) || !ParseAddress(address, addr))
+			continue;
+		while (words >> name)
+			DNSResolver::Hosts.emplace(Lower(name), addr);
+	}
+}
+
+void DNSResolver::SetNameserver(const Flux::string &address, short port)
+{
+	sockaddr_t addr;
+	if (!ParseAddress(address.c_str(), addr))
+		throw DNSException("Invalid nameserver address: %s", address);
+	SetPort(addr, port);
+
+	DNSSocket *						   old;
+	std::vector<Promise<result_t>> waiters;
+	{
+		std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+		DNSResolver::LoadConfig();
+		DNSResolver::Nameserver = addr;
+		old						= DNSResolver::Sock;
+		DNSResolver::Sock		= nullptr;
+		waiters					= DNSResolver::Abandon();
+	}
+
+	delete old;
+	DNSResolver::Fail(waiters, "Nameserver changed");
+}
+
+std::vector<Promise<DNSResolver::result_t>> DNSResolver::Abandon()
+{
+	std::vector<Promise<result_t>> waiters;
+	for (auto &it : DNSResolver::Queries)
+		for (auto &p : it.second.waiters)
+			waiters.push_back(std::move(p));
+
+	DNSResolver::Queries.clear();
+	DNSResolver::IDs.clear();
+	return waiters;
+}
+
+void DNSResolver::Fail(std::vector<Promise<result_t>> &waiters, const Flux::string &error)
+{
+	for (auto &p : waiters)
+		p.set_exception(std::make_exception_ptr(DNSException(error)));
+}
+
+bool DNSResolver::Send(query_t &q)
+{
+	if (!DNSResolver::Sock)
+		DNSResolver::Sock = new DNSSocket(DNSResolver::Nameserver);
+	if (!DNSResolver::Retry)
+		DNSResolver::Retry = new DNSRetryTimer();
+	else if (DNSResolver::Queries.size() == 1)
+		DNSResolver::Retry->Arm(Timeout / 4, Timeout / 4);
+
+	q.tries++;
+	q.sent = std::chrono::steady_clock::now();
+	// Lost packets are retried by Tick() like lost answers are.
+	if (::send(DNSResolver::Sock->GetFD(), q.packet.data(), q.packet.size(), 0) == -1 && errno != EAGAIN && errno != ECONNREFUSED)
+	{
+		"[DNS] Unable to send query: {}"_lw(strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+Future<DNSResolver::result_t> DNSResolver::Resolve(const Flux::string &host, dnsquery_t type)
+{
+	Promise<result_t> promise;
+	Future<result_t>  future = promise.get_future();
+	int				  family = type == DNS_AAAA ? AF_INET6 : AF_INET;
+	std::string		  name	 = Lower(host.c_str());
+
+	sockaddr_t addr;
+	if (ParseAddress(name, addr))
+	{
+		if (addr.sa.sa_family == family)
+			promise.set_value(result_t{ addr });
+		else
+			promise.set_value(result_t());
+		return future;
+	}
+
+	// Encode the question up front, this also checks the name is valid.
+	std::string question;
+	for (size_t start = 0; start <= name.size();)
+	{
+		size_t end = std::min(name.find('.', start), name.size());
+		if (end == start || end - start > 63)
+		{
+			promise.set_exception(std::make_exception_ptr(DNSException("Invalid host name: %s", host)));
+			return future;
+		}
+		question += static_cast<char>(end - start);
+		question += name.substr(start, end - start);
+		start = end + 1;
+	}
+	question += std::string("\0", 1);
+	question += { static_cast<char>(type >> 8), static_cast<char>(type & 0xFF), 0, 1 };
+	if (question.size() > 255 + 4)
+	{
+		promise.set_exception(std::make_exception_ptr(DNSException("Invalid host name: %s", host)));
+		return future;
+	}
+
+	std::string key = name + "/" + std::to_string(type);
+
+	std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+	DNSResolver::LoadConfig();
+
+	if (DNSResolver::Hosts.count(name))
+	{
+		result_t result;
+		auto	 range = DNSResolver::Hosts.equal_range(name);
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second.sa.sa_family == family)
+				result.push_back(it->second);
+		promise.set_value(std::move(result));
+		return future;
+	}
+
+	auto cached = DNSResolver::Cache.find(key);
+	if (cached != DNSResolver::Cache.end())
+	{
+		if (cached->second.expires > std::chrono::steady_clock::now())
+		{
+			promise.set_value(cached->second.addresses);
+			return future;
+		}
+		DNSResolver::Cache.erase(cached);
+	}
+
+	// Somebody already asked, wait for their answer.
+	auto inflight = DNSResolver::Queries.find(key);
+	if (inflight != DNSResolver::Queries.end())
+	{
+		inflight->second.waiters.push_back(std::move(promise));
+		return future;
+	}
+
+	// Random IDs so answers are harder to spoof.
+	static std::mt19937 rng(std::random_device{}());
+	uint16_t			id;
+	do
+		id = rng();
+	while (DNSResolver::IDs.count(id));
+
+	query_t &q = DNSResolver::Queries[key];
+	q.id	   = id;
+	q.type	   = type;
+	q.tries	   = 0;
+	// Header: our id, recursion desired, one question.
+	q.packet = { static_cast<char>(id >> 8), static_cast<char>(id & 0xFF), 1, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+	q.packet += question;
+	q.waiters.push_back(std::move(promise));
+	DNSResolver::IDs[id] = key;
+
+	DNSResolver::Send(q);
+	return future;
+}
+
+void DNSResolver::Received(const unsigned char *packet, size_t len)
+{
+	if (len < 12)
+		return;
+
+	uint16_t id = Get16(packet), flags = Get16(packet + 2);
+	uint16_t qdcount = Get16(packet + 4), ancount = Get16(packet + 6), nscount = Get16(packet + 8);
+
+	std::vector<Promise<result_t>> waiters;
+	result_t					   result;
+	Flux::string				   error;
+	{
+		std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+		auto						idit = DNSResolver::IDs.find(id);
+		if (idit == DNSResolver::IDs.end() || !(flags & 0x8000) || qdcount != 1)
+			return;
+
+		std::string key = idit->second;
+		query_t &	q	= DNSResolver::Queries[key];
+		// The question has to be the one we asked.
+		size_t qlen = q.packet.size() - 12;
+		if (len < 12 + qlen || memcmp(packet + 12, q.packet.data() + 12, qlen))
+			return;
+
+		int		 family = q.type == DNS_AAAA ? AF_INET6 : AF_INET;
+		uint32_t ttl	= MaxTTL;
+		bool	 cache	= true;
+		size_t	 off	= 12 + qlen;
+		int		 rcode	= flags & 0xF;
+
+		for (unsigned i = 0; rcode == 0 && i < ancount; ++i)
+		{
+			off = SkipName(packet, len, off);
+			if (!off || off + 10 > len)
+				break;
+
+			uint16_t rtype = Get16(packet + off), rclass = Get16(packet + off + 2), rdlen = Get16(packet + off + 8);
+			uint32_t rttl = Get32(packet + off + 4);
+			off += 10;
+			if (off + rdlen > len)
+				break;
+
+			// CNAMEs along the way are followed by the nameserver for us,
+			// the addresses are all that matter.
+			if (rtype == q.type && rclass == 1 && rdlen == (family == AF_INET6 ? 16 : 4))
+			{
+				sockaddr_t addr;
+				memset(&addr, 0, sizeof(sockaddr_t));
+				addr.sa.sa_family = family;
+				memcpy(family == AF_INET6 ? static_cast<void *>(&addr.ipv6.sin6_addr) : static_cast<void *>(&addr.ipv4.sin_addr),
+					   packet + off,
+					   rdlen);
+				result.push_back(addr);
+				ttl = std::min(ttl, rttl);
+			}
+			off += rdlen;
+		}
+
+		if (rcode != 0 && rcode != 3)
+		{
+			error = rcode == 2 ? "Nameserver failure" : rcode == 5 ? "Query refused" : "Nameserver error";
+			cache = false;
+		}
+		else if (rcode == 0 && result.empty() && (flags & 0x0200))
+		{
+			// Truncated before the first address, we don't retry over TCP
+			// so this is all there is. It isn't an empty answer though.
+			error = "Truncated answer";
+			cache = false;
+		}
+		else if (result.empty())
+		{
+			// No such host and no such record both come back as no addresses.
+			// How long to remember that comes from the SOA in the authority
+			// section (RFC 2308), without one we don't.
+			cache = false;
+			for (unsigned i = 0; off && i < nscount; ++i)
+			{
+				off = SkipName(packet, len, off);
+				if (!off || off + 10 > len)
+					break;
+
+				uint16_t rtype = Get16(packet + off), rdlen = Get16(packet + off + 8);
+				uint32_t rttl  = Get32(packet + off + 4);
+				size_t	 rdata = off + 10;
+				off			   = rdata + rdlen;
+				if (rtype != DNS_SOA || off > len)
+					continue;
+
+				// MNAME and RNAME come before the numbers.
+				size_t rname   = SkipName(packet, len, rdata);
+				size_t minimum = rname ? SkipName(packet, len, rname) : 0;
+				if (minimum && minimum + 20 <= off)
+				{
+					ttl	  = std::min(rttl, Get32(packet + minimum + 16));
+					cache = true;
+				}
+				break;
+			}
+		}
+		else if (flags & 0x0200)
+			// Truncated, we got at least some addresses but not necessarily
+			// all of them so don't hold on to them.
+			cache = false;
+
+		if (cache && ttl)
+			DNSResolver::Cache[key] = { result, std::chrono::steady_clock::now() + std::chrono::seconds(std::min(ttl, MaxTTL)) };
+
+		waiters.swap(q.waiters);
+		DNSResolver::IDs.erase(idit);
+		DNSResolver::Queries.erase(key);
+	}
+
+	if (!error.empty())
+		DNSResolver::Fail(waiters, error);
+	else
+		for (auto &p : waiters)
+			p.set_value(result);
+}
+
+void DNSResolver::Tick()
+{
+	std::vector<Promise<result_t>> waiters;
+	{
+		std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+		auto						now = std::chrono::steady_clock::now();
+
+		for (auto it = DNSResolver::Queries.begin(); it != DNSResolver::Queries.end();)
+		{
+			query_t &q = it->second;
+			if (now - q.sent < std::chrono::milliseconds(Timeout))
+				++it;
+			else if (q.tries < Tries && DNSResolver::Send(q))
+				++it;
+			else
+			{
+				for (auto &p : q.waiters)
+					waiters.push_back(std::move(p));
+				DNSResolver::IDs.erase(q.id);
+				it = DNSResolver::Queries.erase(it);
+			}
+		}
+
+		if (DNSResolver::Queries.empty() && DNSResolver::Retry)
+			DNSResolver::Retry->Disarm();
+	}
+
+	DNSResolver::Fail(waiters, "Timed out");
+}
+
+void DNSResolver::ClearCache()
+{
+	std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+	DNSResolver::Cache.clear();
+}
+
+void DNSResolver::Terminate()
+{
+	DNSSocket *					   sock;
+	TimerSocket *				   retry;
+	std::vector<Promise<result_t>> waiters;
+	{
+		std::lock_guard<std::mutex> lk(DNSResolver::Lock);
+		sock			   = DNSResolver::Sock;
+		retry			   = DNSResolver::Retry;
+		DNSResolver::Sock  = nullptr;
+		DNSResolver::Retry = nullptr;
+		waiters			   = DNSResolver::Abandon();
+		DNSResolver::Cache.clear();
+		DNSResolver::Hosts.clear();
+		DNSResolver::Configured = false;
+	}
+
+	delete sock;
+	delete retry;
+	DNSResolver::Fail(waiters, "Resolver shut down");
+}
+
+/////////////////////////////// Happy Eyeballs ///////////////////////////////
+
+// One connection attempt, it dies with the first thing it finds out.
+class EyeballAttempt : public Socket
+{
+  public:
+	HappyEyeballs *he;
+	sockaddr_t	   addr;
+	int			   error;
+
+	EyeballAttempt(HappyEyeballs *he, const sockaddr_t &addr) : Socket(-1, addr.sa.sa_family), he(he), addr(addr), error(0)
+	{
+		this->RemoveFlag(MX_READABLE);
+		socklen_t len = addr.sa.sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+		if (this->sock_fd == -1 || (::connect(this->sock_fd, &addr.sa, len) == -1 && errno != EINPROGRESS))
+			this->error = errno;
+		SocketMultiplexer::UpdateSocket(this);
+	}
+
+	~EyeballAttempt()
+	{
+		if (this->he)
+			this->he->attempts.erase(std::find(this->he->attempts.begin(), this->he->attempts.end(), this));
+	}
+
+	bool MultiplexWrite()
+	{
+		int		  optval = 0;
+		socklen_t optlen = sizeof(int);
+		if (getsockopt(this->sock_fd, SOL_SOCKET, SO_ERROR, &optval, &optlen) == -1)
+			optval = errno;
+
+		if (this->he && !optval)
+			this->he->Succeeded(this);
+		else if (this->he)
+			this->he->Failed(this, strerror(optval));
+		return false;
+	}
+
+	void MultiplexError()
+	{
+		int		  optval = 0;
+		socklen_t optlen = sizeof(int);
+		getsockopt(this->sock_fd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+		if (this->he)
+			this->he->Failed(this, strerror(optval ? optval : ECONNREFUSED));
+	}
+};
+
+class EyeballTimer : public TimerSocket
+{
+  public:
+	HappyEyeballs *he;
+
+	EyeballTimer(HappyEyeballs *he, unsigned msec) : TimerSocket(msec, 0), he(he) {}
+
+	~EyeballTimer()
+	{
+		if (this->he && this->he->timer == this)
+			this->he->timer = nullptr;
+	}
+
+	void Tick()
+	{
+		if (!this->he)
+			return;
+
+		auto self		= this->he->shared_from_this();
+		self->timer		= nullptr;
+		this->he		= nullptr;
+		self->Next();
+	}
+};
+
+HappyEyeballs::HappyEyeballs(ConnectionSocket *cs, short port)
+	: cs(cs), port(port), reactor(cs->GetReactor()), resolved{ false, false }, next(0), started(false), timer(nullptr)
+{
+}
+
+HappyEyeballs::~HappyEyeballs()
+{
+	for (auto a : std::vector<EyeballAttempt *>(this->attempts))
+	{
+		a->he = nullptr;
+		delete a;
+	}
+
+	if (this->timer)
+	{
+		this->timer->he = nullptr;
+		delete this->timer;
+	}
+}
+
+std::shared_ptr<HappyEyeballs> HappyEyeballs::Start(ConnectionSocket *cs, const Flux::string &host, short port)
+{
+	auto he = std::make_shared<HappyEyeballs>(cs, port);
+
+	// An unconnected socket polls as hung up, keep it out of the
+	// multiplexer until one of the attempts gives us a connected one.
+	SocketMultiplexer::RemoveSocket(cs);
+
+	std::weak_ptr<HappyEyeballs> weak = he;
+	for (int family : { AF_INET6, AF_INET })
+	{
+		auto state = DNSResolver::Resolve(host, family == AF_INET6 ? DNS_AAAA : DNS_A).GetState();
+		state->OnReady([weak, family, state, reactor = he->reactor]() {
+			SocketMultiplexer::RunOn(reactor, [weak, family, state]() {
+				auto self = weak.lock();
+				if (!self)
+					return;
+
+				std::exception_ptr e = state->GetException();
+				if (!e)
+					return self->Resolved(family, &state->Get(), "");
+
+				try
+				{
+					std::rethrow_exception(e);
+				}
+				catch (const std::exception &ex)
+				{
+					self->Resolved(family, nullptr, ex.what());
+				}
+			});
+		});
+	}
+
+	return he;
+}
+
+void HappyEyeballs::Resolved(int family, const DNSResolver::result_t *result, const Flux::string &error)
+{
+	auto self = this->shared_from_this();
+	int	 idx  = family == AF_INET6 ? 0 : 1;
+
+	this->resolved[idx] = true;
+	if (result)
+	{
+		for (sockaddr_t addr : *result)
+		{
+			SetPort(addr, this->port);
+			this->addresses[idx].push_back(addr);
+		}
+	}
+	else
+		this->lastError = error;
+
+	if (!this->started)
+	{
+		// IPv6 goes ahead right away, IPv4 gives it a moment to catch up.
+		if (idx == 0 || this->resolved[0])
+			this->Next();
+		else if (!this->addresses[1].empty())
+			this->Arm(ResolutionDelay);
+	}
+	else if (!this->timer)
+		// We ran out of things to try while this was outstanding.
+		this->Next();
+}
+
+void HappyEyeballs::Arm(unsigned msec)
+{
+	if (this->timer)
+	{
+		this->timer->he = nullptr;
+		delete this->timer;
+	}
+	this->timer = new EyeballTimer(this, msec);
+}
+
+void HappyEyeballs::Next()
+{
+	auto self	  = this->shared_from_this();
+	this->started = true;
+
+	int family = this->addresses[this->next].empty() ? !this->next : this->next;
+	if (this->addresses[family].empty())
+	{
+		// Everything failed and there's nothing more coming.
+		if (this->attempts.empty() && this->resolved[0] && this->resolved[1])
+		{
+			// Back to the multiplexer to be cleaned up, the same as when
+			// connecting to an address fails.
+			this->cs->RemoveFlag(SS_CONNECTING);
+			this->cs->SetFlag(SS_DEAD);
+			SocketMultiplexer::AddSocket(this->cs);
+			this->cs->OnError(this->lastError.empty() ? "No addresses found" : this->lastError);
+		}
+		return;
+	}
+
+	sockaddr_t addr = this->addresses[family].front();
+	this->addresses[family].pop_front();
+	this->next = !family;
+
+	EyeballAttempt *a = new EyeballAttempt(this, addr);
+	if (a->error)
+	{
+		this->lastError = strerror(a->error);
+		a->he			= nullptr;
+		delete a;
+		return this->Next();
+	}
+
+	this->attempts.push_back(a);
+	this->Arm(ConnectionAttemptDelay);
+}
+
+void HappyEyeballs::Succeeded(EyeballAttempt *a)
+{
+	auto self = this->shared_from_this();
+
+	this->attempts.erase(std::find(this->attempts.begin(), this->attempts.end(), a));
+	a->he = nullptr;
+	for (auto other : std::vector<EyeballAttempt *>(this->attempts))
+	{
+		other->he = nullptr;
+		delete other;
+	}
+	this->attempts.clear();
+
+	if (this->timer)
+	{
+		this->timer->he = nullptr;
+		delete this->timer;
+		this->timer = nullptr;
+	}
+
+	// The attempt closes its own copy of the fd once we return.
+	this->cs->Connected(a->GetFD(), a->addr);
+}
+
+void HappyEyeballs::Failed(EyeballAttempt *a, const Flux::string &error)
+{
+	auto self = this->shared_from_this();
+
+	this->attempts.erase(std::find(this->attempts.begin(), this->attempts.end(), a));
+	a->he			= nullptr;
+	this->lastError = error;
+
+	// No point waiting out the delay, go straight on to the next one.
+	if (this->timer)
+	{
+		this->timer->he = nullptr;
+		delete this->timer;
+		this->timer = nullptr;
+	}
+	this->Next();
+}
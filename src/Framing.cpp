@@ -0,0 +1,137 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "Framing.h"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+typedef size_t (*find_t)(const char *, size_t, char, uint32_t *, size_t);
+
+static size_t FindScalar(const char *data, size_t len, char c, uint32_t *offsets, size_t count)
+{
+	size_t		n   = 0;
+	const char *end = data + len;
+	for (const char *p = data; n < count && p < end; ++p)
+	{
+		p = static_cast<const char *>(memchr(p, c, end - p));
+		if (!p)
+			break;
+		offsets[n++] = p - data;
+	}
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// movemask gives a bit per matching byte of the block, lowest first.
+__attribute__((target("sse2"))) static size_t FindSSE2(const char *data, size_t len, char c, uint32_t *offsets, size_t count)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+	size_t		  i = 0, n = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i  block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		unsigned mask  = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+		// Nothing in this one, probably a long line. Skip ahead four blocks
+		// at a time while there's nothing in those either.
+		while (!mask && i + 80 <= len)
+		{
+			const __m128i *p   = reinterpret_cast<const __m128i *>(data + i + 16);
+			__m128i		   any = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), needle), _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), needle)),
+										  _mm_or_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), needle), _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), needle)));
+			if (_mm_movemask_epi8(any))
+				break;
+			i += 64;
+		}
+
+		for (; mask; mask &= mask - 1)
+		{
+			if (n == count)
+				return n;
+			offsets[n++] = i + __builtin_ctz(mask);
+		}
+	}
+
+	size_t tail = FindScalar(data + i, len - i, c, offsets + n, count - n);
+	for (size_t j = n; j < n + tail; ++j)
+		offsets[j] += i;
+	return n + tail;
+}
+
+__attribute__((target("avx2"))) static size_t FindAVX2(const char *data, size_t len, char c, uint32_t *offsets, size_t count)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	size_t		  i = 0, n = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i  block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		uint32_t mask  = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+		// Same as for SSE2, two blocks at a time.
+		while (!mask && i + 96 <= len)
+		{
+			const __m256i *p  = reinterpret_cast<const __m256i *>(data + i + 32);
+			__m256i		   lo = _mm256_cmpeq_epi8(_mm256_loadu_si256(p), needle);
+			__m256i		   hi = _mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), needle);
+			if (!_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi)))
+				break;
+			i += 64;
+		}
+
+		for (; mask; mask &= mask - 1)
+		{
+			if (n == count)
+				return n;
+			offsets[n++] = i + __builtin_ctz(mask);
+		}
+	}
+
+	size_t tail = FindSSE2(data + i, len - i, c, offsets + n, count - n);
+	for (size_t j = n; j < n + tail; ++j)
+		offsets[j] += i;
+	return n + tail;
+}
+
+static find_t PickFind()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FindAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return FindSSE2;
+	return FindScalar;
+}
+#else
+static find_t PickFind() { return FindScalar; }
+#endif
+
+size_t Framer::Find(const char *data, size_t len, char c, uint32_t *offsets, size_t count)
+{
+	static const find_t find = PickFind();
+	return find(data, len, c, offsets, count);
+}
@@ -23,11 +23,23 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "Socket.h"
+#include "DNS.h"
 #include "Exceptions.h"
+#include "File.h"
 #include "Log.h"
 #include "SocketMultiplexer.h"
+#include <algorithm>
+#include <cstddef>
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 Flux::string Socket::GetAddress(sockaddr_t saddr)
@@ -40,6 +52,15 @@ Flux::string Socket::GetAddress(sockaddr_t saddr)
 			return inet_ntop(AF_INET, &saddr.ipv4.sin_addr, str, INET6_ADDRSTRLEN);
 		case AF_INET6:
 			return inet_ntop(AF_INET6, &saddr.ipv6.sin6_addr, str, INET6_ADDRSTRLEN);
+		case AF_UNIX:
+		{
+			const char *path = saddr.un.sun_path;
+			size_t		max	 = sizeof(saddr.un.sun_path);
+			// The abstract namespace, its leading nul shows as '@'.
+			if (!path[0] && path[1])
+				return "@" + std::string(path + 1, strnlen(path + 1, max - 1));
+			return std::string(path, strnlen(path, max));
+		}
 		default:
 			return "";
 	}
@@ -67,6 +88,18 @@ sockaddr_t Socket::GetSockAddr(int type, const Flux::string &address, int port)
 
 	switch (type)
 	{
+		case AF_UNIX:
+		{
+			// Room for the terminating nul, the abstract namespace has its
+			// nul in front instead.
+			if (address.empty() || address.size() >= sizeof(ret.un.sun_path))
+				return ret;
+			ret.un.sun_family = AF_UNIX;
+			memcpy(ret.un.sun_path, address.c_str(), address.size());
+			if (address[0] == '@')
+				ret.un.sun_path[0] = '\0';
+			return ret;
+		}
 		case AF_INET:
 		{
 			int i = inet_pton(type, address.c_str(), &ret.ipv4.sin_addr);
@@ -77,6 +110,7 @@ sockaddr_t Socket::GetSockAddr(int type, const Flux::string &address, int port)
 				ret.ipv4.sin_family = type;
 				ret.ipv4.sin_port   = htons(port);
 			}
+			break;
 		}
 		case AF_INET6:
 		{
@@ -88,6 +122,7 @@ sockaddr_t Socket::GetSockAddr(int type, const Flux::string &address, int port)
 				ret.ipv6.sin6_family = type;
 				ret.ipv6.sin6_port   = htons(port);
 			}
+			break;
 		}
 		default:
 			break;
@@ -96,7 +131,40 @@ sockaddr_t Socket::GetSockAddr(int type, const Flux::string &address, int port)
 	return ret;
 }
 
-Socket::Socket(int sock, int type, int protocol)
+socklen_t Socket::GetSockLen(const sockaddr_t &saddr)
+{
+	switch (saddr.sa.sa_family)
+	{
+		case AF_INET:
+			return sizeof(sockaddr_in);
+		case AF_INET6:
+			return sizeof(sockaddr_in6);
+		case AF_UNIX:
+		{
+			const char *path = saddr.un.sun_path;
+			size_t		max	 = sizeof(saddr.un.sun_path);
+			// Unnamed, like either end of a socketpair().
+			if (!path[0] && !path[1])
+				return offsetof(sockaddr_un, sun_path);
+			// Abstract names are exactly as long as they are, no nul.
+			if (!path[0])
+				return offsetof(sockaddr_un, sun_path) + 1 + strnlen(path + 1, max - 1);
+			return offsetof(sockaddr_un, sun_path) + strnlen(path, max) + 1;
+		}
+		default:
+			return sizeof(sockaddr_t);
+	}
+}
+
+std::pair<int, int> Socket::Pair(int type)
+{
+	int fds[2];
+	if (::socketpair(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == -1)
+		throw SocketException("Unable to create socket pair: %s", strerror(errno));
+	return std::make_pair(fds[0], fds[1]);
+}
+
+Socket::Socket(int sock, int type, int protocol) : reactor(0)
 {
 	memset(&this->sa, 0, sizeof(sockaddr_t));
 	if (sock == -1)
@@ -125,6 +193,10 @@ void Socket::SetNonBlocking(bool status)
 	// Get the socket flags
 	int flags = fcntl(this->sock_fd, F_GETFL, 0);
 
+	// Accepted sockets usually are already, save the syscall.
+	if (flags != -1 && !(flags & O_NONBLOCK) == !status)
+		return;
+
 	if (status)
 		flags |= O_NONBLOCK;
 	else
@@ -142,14 +214,654 @@ size_t Socket::Write(const void *data, size_t len)
 	return ::send(this->sock_fd, data, len, 0);
 }
 
-size_t Socket::Read(void *data, size_t len) { return ::recv(this->sock_fd, data, len, 0); }
+size_t Socket::Read(void *data, size_t len)
+{
+	{
+		std::lock_guard<std::mutex> lk(this->bufferLock);
+		if (!this->readBuffer.empty())
+		{
+			len = std::min(len, this->readBuffer.size());
+			memcpy(data, this->readBuffer.data(), len);
+			this->readBuffer.erase(0, len);
+			return len;
+		}
+	}
+
+	return ::recv(this->sock_fd, data, len, 0);
+}
+
+void Socket::Received(const void *data, size_t len)
+{
+	std::lock_guard<std::mutex> lk(this->bufferLock);
+	this->readBuffer.append(static_cast<const char *>(data), len);
+}
+
+size_t Socket::Buffered()
+{
+	std::lock_guard<std::mutex> lk(this->bufferLock);
+	return this->readBuffer.size();
+}
 
 bool Socket::MultiplexEvent() { return true; }
 void Socket::MultiplexError() {}
 bool Socket::MultiplexRead() { return true; }
 bool Socket::MultiplexWrite() { return true; }
+bool Socket::MultiplexErrorQueue() { return false; }
+
+// Waiters are resumed on whatever thread, but the flags belong to the
+// socket's reactor, see BufferedSocket::Rearm().
+static void Want(Socket *sock, socketstatus_t flag)
+{
+	int		 fd		 = sock->GetFD();
+	unsigned reactor = sock->GetReactor();
+	SocketMultiplexer::RunOn(reactor, [fd, reactor, flag]() {
+		Socket *s = SocketMultiplexer::FindSocket(fd, reactor);
+		if (!s || s->HasFlag(SS_DEAD) || s->HasFlag(flag))
+			return;
+		s->SetFlag(flag);
+		SocketMultiplexer::UpdateSocket(s);
+	});
+}
+
+void Socket::OnReadable(function_t &&func)
+{
+	{
+		std::lock_guard<std::mutex> lk(this->waiterLock);
+		this->readWaiter = std::move(func);
+	}
+
+	Want(this, MX_READABLE);
+}
+
+void Socket::OnWritable(function_t &&func)
+{
+	{
+		std::lock_guard<std::mutex> lk(this->waiterLock);
+		this->writeWaiter = std::move(func);
+	}
+
+	Want(this, MX_WRITABLE);
+}
+
+bool Socket::NotifyWaiters(bool readable, bool writable)
+{
+	function_t r, w;
+	{
+		std::lock_guard<std::mutex> lk(this->waiterLock);
+		if (readable)
+			r = std::move(this->readWaiter);
+		if (writable)
+			w = std::move(this->writeWaiter);
+	}
+
+	// Run them unlocked, they may well wait on the socket again.
+	if (r)
+		r();
+	if (w)
+		w();
+	return r || w;
+}
+
+BufferedSocket::BufferedSocket()
+	: paused(false), eof(false), sendQueued(0), sendFlushed(0), zeroCopy(0), zeroCopyNext(0), zeroCopyDone(0), recvHighWater(1 << 20),
+	  sendHighWater(1 << 20)
+{
+}
+
+BufferedSocket::~BufferedSocket()
+{
+	// The kernel holds on to the pages of zero copy sends it still has, the
+	// memory can go.
+	for (auto &seg : this->segments)
+	{
+		if (seg.release)
+			seg.release();
+		if (seg.pass != -1)
+			::close(seg.pass);
+	}
+	for (auto &seg : this->zeroCopyPending)
+		seg.release();
+	for (int fd : this->passed)
+		::close(fd);
+}
+
+void BufferedSocket::Pressure()
+{
+	size_t recvd, queued;
+	{
+		std::lock_guard<std::mutex> lk(this->recvLock);
+		recvd = this->recvBuffer.size();
+	}
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		queued = this->sendBuffer.size();
+	}
+
+	bool full = (this->recvHighWater && recvd >= this->recvHighWater) || (this->sendHighWater && queued >= this->sendHighWater);
+	bool low  = (!this->recvHighWater || recvd <= this->recvHighWater / 2) && (!this->sendHighWater || queued <= this->sendHighWater / 2);
+
+	if ((full && !this->paused.exchange(true)) || (low && !this->eof && this->paused.exchange(false)))
+		this->Rearm();
+}
+
+void BufferedSocket::Rearm()
+{
+	// Looked up again on the reactor, we may be gone by the time it gets
+	// round to it.
+	int		 fd		 = this->sock_fd;
+	unsigned reactor = this->reactor;
+	SocketMultiplexer::RunOn(reactor, [fd, reactor]() {
+		BufferedSocket *s = dynamic_cast<BufferedSocket *>(SocketMultiplexer::FindSocket(fd, reactor));
+		if (!s || s->HasFlag(SS_DEAD))
+			return;
+
+		bool pending;
+		{
+			std::lock_guard<std::mutex> lk(s->sendLock);
+			pending = !s->sendBuffer.empty() || !s->segments.empty();
+		}
+		bool reading = !s->paused && !s->eof;
+
+		// Nothing goes out before a connect() finishes, Dispatch() flushes
+		// what was queued in the meantime once it does.
+		bool writing = pending && !s->HasFlag(SS_CONNECTING) && !s->HasFlag(MX_WRITABLE);
+		if (!writing && reading == s->HasFlag(MX_READABLE))
+			return;
+
+		if (writing)
+			s->SetFlag(MX_WRITABLE);
+		if (reading)
+			s->SetFlag(MX_READABLE);
+		else
+			s->RemoveFlag(MX_READABLE);
+		SocketMultiplexer::UpdateSocket(s);
+	});
+}
+
+size_t BufferedSocket::Write(const void *data, size_t len)
+{
+	if (!data || !len)
+		return 0;
+
+	bool idle;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		idle = this->sendBuffer.empty() && this->segments.empty();
+		this->sendBuffer.Write(data, len);
+		this->sendQueued += len;
+	}
+
+	// Otherwise we're already waiting to be writable.
+	if (idle)
+		this->Rearm();
+
+	this->Pressure();
+	return len;
+}
+
+void BufferedSocket::Queue(segment_t &&seg)
+{
+	bool idle;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		idle   = this->sendBuffer.empty() && this->segments.empty();
+		seg.at = this->sendQueued;
+		this->segments.push_back(std::move(seg));
+	}
+
+	if (idle)
+		this->Rearm();
+}
+
+void BufferedSocket::SendFile(File *f, off_t offset, size_t len, function_t &&done)
+{
+	if (!f || !len)
+	{
+		if (done)
+			done();
+		return;
+	}
+
+	this->Queue({ 0, f->GetFD(), -1, nullptr, offset, len, 0, std::move(done) });
+}
+
+void BufferedSocket::SendZeroCopy(const void *data, size_t len, function_t &&release)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	bool pin = false;
+	if (data && len >= ZeroCopyMin)
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		const int					on = 1;
+		if (!this->zeroCopy)
+			this->zeroCopy = setsockopt(this->sock_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) ? -1 : 1;
+		pin = this->zeroCopy > 0;
+	}
+
+	if (pin)
+	{
+		this->Queue({ 0, -1, -1, static_cast<const char *>(data), 0, len, 0, std::move(release) });
+		return;
+	}
+#endif
+
+	this->Write(data, len);
+	if (release)
+		release();
+}
+
+void BufferedSocket::SendFD(int fd, const void *data, size_t len)
+{
+	if (!data || !len)
+		throw SocketException("Passing an fd needs at least a byte to go with it");
+
+	// Ours until it's sent, the caller may close theirs straight away.
+	int pass = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (pass == -1)
+		throw SocketException("Unable to duplicate fd %s: %s", fd, strerror(errno));
+
+	bool idle;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		idle = this->sendBuffer.empty() && this->segments.empty();
+		this->segments.push_back({ this->sendQueued, -1, pass, nullptr, 0, 0, 0, function_t() });
+		this->sendBuffer.Write(data, len);
+		this->sendQueued += len;
+	}
+
+	if (idle)
+		this->Rearm();
+
+	this->Pressure();
+}
+
+int BufferedSocket::ReceiveFD()
+{
+	std::lock_guard<std::mutex> lk(this->recvLock);
+	if (this->passed.empty())
+		return -1;
+
+	int fd = this->passed.front();
+	this->passed.pop_front();
+	return fd;
+}
+
+size_t BufferedSocket::Read(void *data, size_t len)
+{
+	{
+		std::lock_guard<std::mutex> lk(this->recvLock);
+		if (this->recvBuffer.empty())
+		{
+			if (this->eof)
+				return 0;
+			errno = EAGAIN;
+			return static_cast<size_t>(-1);
+		}
+
+		len = this->recvBuffer.Read(data, len);
+	}
+
+	this->Pressure();
+	return len;
+}
+
+bool BufferedSocket::MultiplexRead()
+{
+	static constexpr size_t ReadChunk = 16384;
+	bool					got = false;
+	// OnRead() hears about the peer closing once.
+	bool closed = this->eof;
+
+	{
+		std::lock_guard<std::mutex> lk(this->recvLock);
+
+		// Engines that read for us (io_uring) already drained the socket,
+		// reading it as well could get the data out of order.
+		{
+			std::lock_guard<std::mutex> blk(this->bufferLock);
+			if (!this->readBuffer.empty())
+			{
+				this->recvBuffer.Write(this->readBuffer.data(), this->readBuffer.size());
+				this->readBuffer.clear();
+				got = true;
+			}
+		}
+
+		while (!got && !this->eof && (!this->recvHighWater || this->recvBuffer.size() < this->recvHighWater))
+		{
+			iovec  iov[2];
+			int	count = this->recvBuffer.Space(iov, ReadChunk);
+			// Room for fds passed over a UNIX socket, see SendFD().
+			char   control[CMSG_SPACE(sizeof(int) * 16)];
+			msghdr msg;
+			memset(&msg, 0, sizeof(msghdr));
+			msg.msg_iov		   = iov;
+			msg.msg_iovlen	   = count;
+			msg.msg_control	   = control;
+			msg.msg_controllen = sizeof(control);
+
+			ssize_t len	= ::recvmsg(this->sock_fd, &msg, MSG_CMSG_CLOEXEC);
+			bool	fds = false;
+			if (len >= 0)
+			{
+				for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+				{
+					if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+						continue;
+
+					size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+					for (size_t i = 0; i < n; ++i)
+					{
+						int fd;
+						memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+						this->passed.push_back(fd);
+					}
+					fds = n > 0;
+				}
+			}
+
+			if (len > 0)
+			{
+				this->recvBuffer.Commit(len);
+				// A short read emptied the socket, no need to go on to EAGAIN.
+				// Except the kernel ends a read early at a passed fd.
+				if (!fds && static_cast<size_t>(len) < iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0))
+				{
+					got = true;
+					break;
+				}
+				continue;
+			}
+			else if (len == 0)
+				this->eof = true;
+			else if (errno == EINTR)
+				continue;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			break;
+		}
+
+		got = got || !this->recvBuffer.empty();
+	}
+
+	// Nothing more will come, don't let level-triggered engines keep
+	// telling us about it.
+	if (this->eof && !closed)
+	{
+		this->RemoveFlag(MX_READABLE);
+		SocketMultiplexer::UpdateSocket(this);
+	}
+
+	this->Pressure();
+	if (got || (this->eof && !closed))
+		return this->OnRead();
+	return true;
+}
+
+bool BufferedSocket::ReapZeroCopy(std::vector<function_t> &done)
+{
+	bool notified = false;
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	if (this->zeroCopyNext == this->zeroCopyDone)
+		return false;
+
+	for (;;)
+	{
+		char   control[128];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msghdr));
+		msg.msg_control	= control;
+		msg.msg_controllen = sizeof(control);
+
+		if (::recvmsg(this->sock_fd, &msg, MSG_ERRQUEUE) == -1)
+			break;
+
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			// The kernel reports ranges of sends it's done with, [ee_info, ee_data].
+			const sock_extended_err *ee = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cm));
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			notified = true;
+			if (static_cast<int32_t>(ee->ee_data + 1 - this->zeroCopyDone) > 0)
+				this->zeroCopyDone = ee->ee_data + 1;
+		}
+	}
+
+	while (!this->zeroCopyPending.empty() && static_cast<int32_t>(this->zeroCopyPending.front().last - this->zeroCopyDone) < 0)
+	{
+		done.push_back(std::move(this->zeroCopyPending.front().release));
+		this->zeroCopyPending.pop_front();
+	}
+#endif
+	return notified;
+}
+
+bool BufferedSocket::MultiplexWrite()
+{
+	std::vector<function_t>		 done;
+	std::unique_lock<std::mutex> lk(this->sendLock);
+	this->ReapZeroCopy(done);
+
+	for (;;)
+	{
+		// First whatever in the ring was queued before the next segment.
+		iovec	iov[2];
+		int		count = this->sendBuffer.Data(iov);
+		uint64_t limit = this->segments.empty() ? UINT64_MAX : this->segments.front().at - this->sendFlushed;
+		if (count && limit)
+		{
+			if (iov[0].iov_len >= limit)
+			{
+				iov[0].iov_len = limit;
+				count		   = 1;
+			}
+			else if (count > 1 && iov[0].iov_len + iov[1].iov_len > limit)
+				iov[1].iov_len = limit - iov[0].iov_len;
+
+			msghdr msg;
+			memset(&msg, 0, sizeof(msghdr));
+			msg.msg_iov	= iov;
+			msg.msg_iovlen = count;
+
+			ssize_t len = ::sendmsg(this->sock_fd, &msg, MSG_NOSIGNAL);
+			if (len >= 0)
+			{
+				this->sendBuffer.Consume(len);
+				this->sendFlushed += len;
+				continue;
+			}
+		}
+		// A passed fd goes with the byte queued right after it, the rest
+		// goes out the usual way.
+		else if (!this->segments.empty() && this->segments.front().pass != -1)
+		{
+			segment_t &seg = this->segments.front();
+			char	   control[CMSG_SPACE(sizeof(int))];
+			memset(control, 0, sizeof(control));
+			iov[0].iov_len = 1;
+
+			msghdr msg;
+			memset(&msg, 0, sizeof(msghdr));
+			msg.msg_iov		   = iov;
+			msg.msg_iovlen	   = 1;
+			msg.msg_control	   = control;
+			msg.msg_controllen = sizeof(control);
+
+			cmsghdr *cm	   = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type  = SCM_RIGHTS;
+			cm->cmsg_len   = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &seg.pass, sizeof(int));
+
+			ssize_t len = ::sendmsg(this->sock_fd, &msg, MSG_NOSIGNAL);
+			if (len > 0)
+			{
+				this->sendBuffer.Consume(len);
+				this->sendFlushed += len;
+				::close(seg.pass);
+				this->segments.pop_front();
+				continue;
+			}
+		}
+		else if (!this->segments.empty())
+		{
+			segment_t &seg = this->segments.front();
+			ssize_t	len;
+			if (seg.fd != -1)
+				len = ::sendfile(this->sock_fd, seg.fd, &seg.offset, seg.len);
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+			else
+			{
+				len = ::send(this->sock_fd, seg.data, seg.len, MSG_NOSIGNAL | MSG_ZEROCOPY);
+				// Out of memory to pin pages with, copy this piece.
+				if (len == -1 && errno == ENOBUFS)
+					len = ::send(this->sock_fd, seg.data, seg.len, MSG_NOSIGNAL);
+				else if (len > 0)
+					seg.last = this->zeroCopyNext++;
+			}
+#else
+			else
+				len = ::send(this->sock_fd, seg.data, seg.len, MSG_NOSIGNAL);
+#endif
+
+			if (len >= 0)
+			{
+				seg.len -= len;
+				seg.data += seg.fd == -1 ? len : 0;
+
+				// sendfile() gives 0 at the end of the file, it's shorter than we were told.
+				if (!seg.len || (!len && seg.fd != -1))
+				{
+					if (seg.fd == -1 && this->zeroCopyNext != this->zeroCopyDone)
+						this->zeroCopyPending.push_back(std::move(seg));
+					else if (seg.release)
+						done.push_back(std::move(seg.release));
+					this->segments.pop_front();
+				}
+				continue;
+			}
+		}
+		else
+			break;
+
+		if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		return false;
+	}
+
+	// Still more to go, wait for the next time we're writable.
+	if (!this->sendBuffer.empty() || !this->segments.empty())
+		this->SetFlag(MX_WRITABLE);
+	lk.unlock();
+
+	// Unlocked, they may well queue more.
+	for (auto &func : done)
+		func();
+
+	this->Pressure();
+	return true;
+}
+
+bool BufferedSocket::MultiplexErrorQueue()
+{
+	std::vector<function_t> done;
+	bool					notified;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		notified = this->ReapZeroCopy(done);
+	}
+
+	for (auto &func : done)
+		func();
+	return notified;
+}
+
+void BufferedSocket::SetHighWater(size_t recv, size_t send)
+{
+	this->recvHighWater = recv;
+	this->sendHighWater = send;
+	this->Pressure();
+}
+
+size_t BufferedSocket::ReadQueued()
+{
+	std::lock_guard<std::mutex> lk(this->recvLock);
+	return this->recvBuffer.size();
+}
+
+size_t BufferedSocket::WriteQueued()
+{
+	std::lock_guard<std::mutex> lk(this->sendLock);
+	size_t						queued = this->sendBuffer.size();
+	for (auto &seg : this->segments)
+		queued += seg.len;
+	return queued;
+}
+
+TimerSocket::TimerSocket(unsigned msec, unsigned interval, function_t &&func)
+	: Socket(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), AF_UNSPEC), func(std::move(func)), once(!interval)
+{
+	if (this->sock_fd == -1)
+		throw SocketException("Unable to create timer: %s", strerror(errno));
+
+	this->RemoveFlag(MX_WRITABLE);
+	SocketMultiplexer::UpdateSocket(this);
+	this->Arm(msec, interval);
+}
+
+void TimerSocket::Arm(unsigned msec, unsigned interval)
+{
+	itimerspec its;
+	memset(&its, 0, sizeof(itimerspec));
+	// All zero would disarm it.
+	msec					= std::max(msec, 1u);
+	its.it_value.tv_sec		= msec / 1000;
+	its.it_value.tv_nsec	= (msec % 1000) * 1000000L;
+	its.it_interval.tv_sec  = interval / 1000;
+	its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	timerfd_settime(this->sock_fd, 0, &its, nullptr);
+}
+
+void TimerSocket::Disarm()
+{
+	itimerspec its;
+	memset(&its, 0, sizeof(itimerspec));
+	timerfd_settime(this->sock_fd, 0, &its, nullptr);
+}
+
+bool TimerSocket::MultiplexRead()
+{
+	uint64_t expirations;
+	// Nothing to read, someone re-armed or disarmed us in the meantime.
+	if (::read(this->sock_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return true;
+
+	this->Tick();
+	return !this->once;
+}
+
+void TimerSocket::Tick()
+{
+	if (this->func)
+		this->func();
+}
 
 ConnectionSocket::ConnectionSocket(bool ipv6) : Socket(-1, ipv6) {}
+
+ConnectionSocket::ConnectionSocket(int fd, const sockaddr_t &addr) : Socket(fd, addr.sa.sa_family), port(0)
+{
+	memcpy(&this->sa, &addr, sizeof(sockaddr_t));
+	this->address = Socket::GetAddress(addr);
+	this->SetFlag(SS_CONNECTED);
+}
+
 ConnectionSocket::~ConnectionSocket() {}
 void ConnectionSocket::OnError(const Flux::string &) {}
 
@@ -196,29 +908,42 @@ void ConnectionSocket::Connect(const Flux::string &conaddr, short port)
 	this->address = conaddr;
 	this->port	= port;
 
-	// Get our address family.
-	this->sa.sa.sa_family = (conaddr.find(":") != Flux::string::npos ? AF_INET6 : AF_INET);
-	// Set our port
-	*(this->sa.sa.sa_family == AF_INET ? &this->sa.ipv4.sin_port : &this->sa.ipv6.sin6_port) = htons(port);
+	// A path, or '@' and a name in the abstract namespace.
+	if (!conaddr.empty() && (conaddr[0] == '/' || conaddr[0] == '@'))
+	{
+		this->sa = Socket::GetSockAddr(AF_UNIX, conaddr, 0);
+		if (!this->sa.sa.sa_family)
+			throw SocketException("Invalid path: %s", conaddr);
+	}
+	else
+	{
+		// Get our address family.
+		this->sa.sa.sa_family = (conaddr.find(":") != Flux::string::npos ? AF_INET6 : AF_INET);
+		// Set our port
+		*(this->sa.sa.sa_family == AF_INET ? &this->sa.ipv4.sin_port : &this->sa.ipv6.sin6_port) = htons(port);
 
-	// Convert our address to a sockaddr_t structure.
-	int value = -1;
-	if (this->sa.sa.sa_family == AF_INET)
-		value = inet_pton(this->sa.sa.sa_family, conaddr.c_str(), &this->sa.ipv4.sin_addr);
-	else if (this->sa.sa.sa_family == AF_INET6)
-		value = inet_pton(this->sa.sa.sa_family, conaddr.c_str(), &this->sa.ipv6.sin6_addr);
+		// Convert our address to a sockaddr_t structure.
+		int value = -1;
+		if (this->sa.sa.sa_family == AF_INET)
+			value = inet_pton(this->sa.sa.sa_family, conaddr.c_str(), &this->sa.ipv4.sin_addr);
+		else if (this->sa.sa.sa_family == AF_INET6)
+			value = inet_pton(this->sa.sa.sa_family, conaddr.c_str(), &this->sa.ipv6.sin6_addr);
 
-	switch (value)
-	{
-		case 1: // success
-			break;
-		case 0:
-			throw SocketException("Invalid host");
-		default:
-			throw SocketException("Invalid host: %s", strerror(errno));
+		switch (value)
+		{
+			case 1: // success
+				break;
+			case 0:
+				// Not an address, look it up.
+				this->SetFlag(SS_CONNECTING);
+				this->eyeballs = HappyEyeballs::Start(this, conaddr, port);
+				return;
+			default:
+				throw SocketException("Invalid host: %s", strerror(errno));
+		}
 	}
 
-	if (::connect(this->sock_fd, &this->sa.sa, sizeof(struct sockaddr)) == -1)
+	if (::connect(this->sock_fd, &this->sa.sa, Socket::GetSockLen(this->sa)) == -1)
 	{
 		if (errno != EINPROGRESS)
 			this->OnError(strerror(errno));
@@ -235,12 +960,45 @@ void ConnectionSocket::Connect(const Flux::string &conaddr, short port)
 	}
 }
 
-ListeningSocket::ListeningSocket(const Flux::string &bindaddr, short port, bool ipv6) : Socket(-1, ipv6)
+void ConnectionSocket::Connected(int fd, const sockaddr_t &addr)
+{
+	// Same fd number so we keep our slot, but the multiplexer has to forget
+	// the old socket and pick up the new one.
+	SocketMultiplexer::RemoveSocket(this);
+	if (dup3(fd, this->sock_fd, O_CLOEXEC) == -1)
+	{
+		int error = errno;
+		this->RemoveFlag(SS_CONNECTING);
+		this->SetFlag(SS_DEAD);
+		SocketMultiplexer::AddSocket(this);
+		this->OnError(strerror(error));
+		return;
+	}
+	memcpy(&this->sa, &addr, sizeof(sockaddr_t));
+
+	SocketMultiplexer::AddSocket(this);
+	this->SetFlags(MX_READABLE, MX_WRITABLE);
+	SocketMultiplexer::UpdateSocket(this);
+
+	this->eyeballs.reset();
+	this->RemoveFlag(SS_CONNECTING);
+	this->SetFlag(SS_CONNECTED);
+	this->OnConnect();
+}
+
+ListeningSocket::ListeningSocket(const Flux::string &bindaddr, short port, bool ipv6, bool reuseport)
+	: Socket(-1, ipv6), nextReactor(0), acceptBatch(64), spread(false)
 {
 retry:
 	memset(&this->sa, 0, sizeof(sockaddr_t));
 	const char op = 1;
 	setsockopt(this->sock_fd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof(op));
+	if (reuseport)
+	{
+		const int on = 1;
+		if (setsockopt(this->sock_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+			"Unable to set SO_REUSEPORT on socket {}: {}"_lw(this->sock_fd, strerror(errno));
+	}
 
 	// Set some variables.
 	this->address = bindaddr;
@@ -296,32 +1054,105 @@ retry:
 		throw SocketException("Unable to listen: %s", strerror(errno));
 }
 
-ListeningSocket::~ListeningSocket() {}
-
-bool ListeningSocket::MultiplexRead()
+ListeningSocket::ListeningSocket(const Flux::string &path, int type)
+	: Socket(-1, AF_UNIX, type), nextReactor(0), address(path), port(0), ipv6(false), acceptBatch(64), spread(false)
 {
-	sockaddr_t addr;
+	// Our Socket(-1, AF_UNIX, type) is ignored when the subclass constructs
+	// Socket itself, make sure it made the right one.
+	int		  domain = 0, stype = 0;
+	socklen_t len	 = sizeof(int);
+	getsockopt(this->sock_fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+	len = sizeof(int);
+	getsockopt(this->sock_fd, SOL_SOCKET, SO_TYPE, &stype, &len);
+	if (domain != AF_UNIX || stype != type)
+		throw SocketException("A UNIX listener needs Socket(-1, AF_UNIX, %s), not %s/%s", type, domain, stype);
 
-	socklen_t size	= sizeof(sockaddr_t);
-	int		  newsock = accept(this->sock_fd, &addr.sa, &size);
+	this->sa = Socket::GetSockAddr(AF_UNIX, path, 0);
+	if (!this->sa.sa.sa_family)
+		throw SocketException("Invalid path: %s", path);
 
-	if (newsock >= 0)
+	if (::bind(this->sock_fd, &this->sa.sa, Socket::GetSockLen(this->sa)) == -1)
 	{
-		ClientSocket *cs = this->OnAccept(newsock, addr);
-		if (cs)
+		// Left behind by a listener that didn't get to clean up? Only if
+		// nobody answers on it.
+		int			error = errno;
+		struct stat st;
+		bool		stale = error == EADDRINUSE && path[0] != '@' && !stat(path.c_str(), &st) && S_ISSOCK(st.st_mode);
+		if (stale)
 		{
-			cs->SetFlag(SS_ACCEPTED);
-			cs->OnAccept();
+			int probe = ::socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+			stale	 = probe != -1 && ::connect(probe, &this->sa.sa, Socket::GetSockLen(this->sa)) == -1 && errno == ECONNREFUSED;
+			if (probe != -1)
+				::close(probe);
 		}
+
+		if (!stale)
+			throw SocketException("Unable to bind to %s: %s", path, strerror(error));
+		if (unlink(path.c_str()) == -1 || ::bind(this->sock_fd, &this->sa.sa, Socket::GetSockLen(this->sa)) == -1)
+			throw SocketException("Unable to bind to %s: %s", path, strerror(errno));
+	}
+
+	if (::listen(this->sock_fd, SOMAXCONN) == -1)
+		throw SocketException("Unable to listen: %s", strerror(errno));
+}
+
+ListeningSocket::~ListeningSocket()
+{
+	if (this->sa.sa.sa_family == AF_UNIX && this->sa.un.sun_path[0])
+		unlink(this->sa.un.sun_path);
+}
+
+bool ListeningSocket::MultiplexRead()
+{
+	for (size_t i = 0; i < this->acceptBatch; ++i)
+	{
+		sockaddr_t addr;
+		socklen_t  size	= sizeof(sockaddr_t);
+		int		   newsock = accept4(this->sock_fd, &addr.sa, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (newsock >= 0)
+			this->Accepted(newsock, addr);
+		// The client gave up while it was waiting, there may be more.
+		else if (errno == EINTR || errno == ECONNABORTED)
+			continue;
 		else
-			throw SocketException("ListenSocket::OnAccept() returned nullptr for client socket");
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				"Unable to accept connection: {}"_lw(strerror(errno));
+			break;
+		}
 	}
-	else
-		"Unable to accept connection: {}"_lw(strerror(errno));
 
 	return true;
 }
 
+void ListeningSocket::SetAcceptBatch(size_t batch, bool spread)
+{
+	this->acceptBatch = std::max<size_t>(batch, 1);
+	this->spread	  = spread;
+}
+
+void ListeningSocket::Accepted(int fd, const sockaddr_t &addr)
+{
+	unsigned reactors = this->spread ? SocketMultiplexer::ReactorCount() : 1;
+	unsigned reactor  = reactors > 1 ? this->nextReactor++ % reactors : this->reactor;
+
+	if (reactor == this->reactor)
+		this->Adopt(fd, addr);
+	else
+		SocketMultiplexer::RunOn(reactor, [this, fd, addr]() { this->Adopt(fd, addr); });
+}
+
+void ListeningSocket::Adopt(int fd, const sockaddr_t &addr)
+{
+	ClientSocket *cs = this->OnAccept(fd, addr);
+	if (!cs)
+		throw SocketException("ListenSocket::OnAccept() returned nullptr for client socket");
+
+	cs->SetFlag(SS_ACCEPTED);
+	cs->OnAccept();
+}
+
 ClientSocket::ClientSocket(ListeningSocket *ls, int fd, const sockaddr_t &addr, bool ipv6) : Socket(fd, false), ls(ls)
 {
 	this->SetFlag(SS_ACCEPTING);
@@ -354,3 +1185,431 @@ void ClientSocket::MultiplexError()
 
 void ClientSocket::OnAccept() {}
 void ClientSocket::OnError(const Flux::string &str) {}
+
+DatagramSocket::DatagramSocket(const Flux::string &bindaddr, short port, bool ipv6, bool reuseport)
+	: Socket(-1, ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM), pendingBytes(0), reading(false), armed(false), gso(0), gro(false), batchCount(0),
+	  batchSize(0), dropped(0), sendHighWater(4 << 20)
+{
+	if (this->sock_fd == -1)
+		throw SocketException("Unable to create socket: %s", strerror(errno));
+
+	// Nothing to send yet.
+	this->RemoveFlag(MX_WRITABLE);
+	SocketMultiplexer::UpdateSocket(this);
+
+	// Room for anything that came in one ethernet frame.
+	this->SetBatch(32, 2048);
+	this->sendMsgs.resize(64);
+	this->sendIov.resize(64);
+	this->sendControl.resize(64 * CMSG_SPACE(sizeof(uint16_t)));
+
+	if (reuseport)
+	{
+		const int on = 1;
+		if (setsockopt(this->sock_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+			"Unable to set SO_REUSEPORT on socket {}: {}"_lw(this->sock_fd, strerror(errno));
+	}
+
+	if (bindaddr.empty())
+		return;
+
+	this->sa = Socket::GetSockAddr(ipv6 ? AF_INET6 : AF_INET, bindaddr, port);
+	if (!this->sa.sa.sa_family)
+		throw SocketException("Invalid host: %s", bindaddr);
+
+	if (::bind(this->sock_fd, &this->sa.sa, Socket::GetSockLen(this->sa)) == -1)
+		throw SocketException("Unable to bind to %s:%s: %s", bindaddr, port, strerror(errno));
+}
+
+DatagramSocket::~DatagramSocket() {}
+
+void DatagramSocket::SetBatch(size_t count, size_t size)
+{
+	count = std::clamp<size_t>(count, 1, UIO_MAXIOV);
+	size  = std::clamp<size_t>(size, 1, 65535);
+
+	this->batchCount = count;
+	this->batchSize  = size;
+	this->recvData.resize(count * size);
+	this->recvControl.resize(count * CMSG_SPACE(sizeof(int)));
+	this->recvMsgs.resize(count);
+	this->recvIov.resize(count);
+	this->recvAddrs.resize(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		this->recvIov[i].iov_base = &this->recvData[i * size];
+		this->recvIov[i].iov_len  = size;
+
+		msghdr &msg = this->recvMsgs[i].msg_hdr;
+		memset(&msg, 0, sizeof(msghdr));
+		msg.msg_name	= &this->recvAddrs[i];
+		msg.msg_iov		= &this->recvIov[i];
+		msg.msg_iovlen  = 1;
+		msg.msg_control = &this->recvControl[i * CMSG_SPACE(sizeof(int))];
+	}
+}
+
+bool DatagramSocket::EnableGRO()
+{
+#ifdef UDP_GRO
+	const int on = 1;
+	if (setsockopt(this->sock_fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+		return false;
+
+	this->gro = true;
+	// Fewer but bigger, a batch of 64k each adds up fast.
+	if (this->batchSize < 65535)
+		this->SetBatch(std::min<size_t>(this->batchCount, 16), 65535);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void DatagramSocket::SetHighWater(size_t send)
+{
+	std::lock_guard<std::mutex> lk(this->sendLock);
+	this->sendHighWater = send;
+}
+
+void DatagramSocket::Queue(const sockaddr_t &to, const void *data, size_t len, uint16_t segment)
+{
+	pending_t p;
+	p.addr = to;
+	p.data.assign(static_cast<const char *>(data), len);
+	p.segment = segment;
+	this->pendingBytes += len;
+	this->pending.push_back(std::move(p));
+}
+
+bool DatagramSocket::Arm(bool wanted)
+{
+	if (!wanted || this->armed)
+		return false;
+	this->armed = true;
+	return true;
+}
+
+void DatagramSocket::WaitWritable()
+{
+	// Only our reactor touches the flags, see BufferedSocket::Rearm().
+	int		 fd		 = this->sock_fd;
+	unsigned reactor = this->reactor;
+	SocketMultiplexer::RunOn(reactor, [fd, reactor]() {
+		DatagramSocket *s = dynamic_cast<DatagramSocket *>(SocketMultiplexer::FindSocket(fd, reactor));
+		if (!s || s->HasFlag(SS_DEAD) || s->HasFlag(MX_WRITABLE))
+			return;
+		s->SetFlag(MX_WRITABLE);
+		SocketMultiplexer::UpdateSocket(s);
+	});
+}
+
+bool DatagramSocket::SendTo(const sockaddr_t &to, const void *data, size_t len)
+{
+	bool arm;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		if (this->sendHighWater && this->pendingBytes + len > this->sendHighWater)
+		{
+			++this->dropped;
+			return false;
+		}
+
+		this->Queue(to, data, len, 0);
+		// A full batch won't get any cheaper by waiting. Otherwise the read
+		// handler sends it on its way out, or we wait to be writable.
+		if (this->pending.size() >= this->sendMsgs.size())
+			arm = this->Arm(!this->SendQueued() && !this->reading);
+		else
+			arm = this->Arm(!this->reading);
+	}
+
+	if (arm)
+		this->WaitWritable();
+	return true;
+}
+
+size_t DatagramSocket::SendTo(const datagram_t *datagrams, size_t count)
+{
+	size_t queued = 0;
+	bool   arm;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (this->sendHighWater && this->pendingBytes + datagrams[i].len > this->sendHighWater)
+			{
+				this->dropped += count - i;
+				break;
+			}
+			this->Queue(datagrams[i].addr, datagrams[i].data, datagrams[i].len, 0);
+			++queued;
+		}
+
+		arm = this->Arm(!this->SendQueued() && !this->reading);
+	}
+
+	if (arm)
+		this->WaitWritable();
+	return queued;
+}
+
+bool DatagramSocket::SendBurst(const sockaddr_t &to, const void *data, size_t len, uint16_t segment)
+{
+	if (!segment)
+		return false;
+
+	const char *p = static_cast<const char *>(data);
+	bool		arm;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		if (this->sendHighWater && this->pendingBytes + len > this->sendHighWater)
+		{
+			this->dropped += (len + segment - 1) / segment;
+			return false;
+		}
+
+#ifdef UDP_SEGMENT
+		// Kernels before UDP_SEGMENT would ignore the cmsg and send it all
+		// as one datagram, ask first.
+		if (!this->gso)
+		{
+			int		  value = 0;
+			socklen_t size  = sizeof(value);
+			this->gso		= getsockopt(this->sock_fd, SOL_UDP, UDP_SEGMENT, &value, &size) == -1 ? -1 : 1;
+		}
+#else
+		this->gso = -1;
+#endif
+
+		// One GSO send is at most 64 segments and has to fit one IP packet.
+		size_t chunk = this->gso == 1 ? std::min<size_t>(MaxSegments, 65000 / segment) * segment : segment;
+		chunk		 = std::max<size_t>(chunk, segment);
+		size_t off = 0;
+		do
+		{
+			size_t n = std::min(chunk, len - off);
+			this->Queue(to, p + off, n, n > segment ? segment : 0);
+			off += n;
+		} while (off < len);
+
+		arm = this->Arm(!this->SendQueued() && !this->reading);
+	}
+
+	if (arm)
+		this->WaitWritable();
+	return true;
+}
+
+void DatagramSocket::Flush()
+{
+	bool arm;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		arm = this->Arm(!this->SendQueued() && !this->reading);
+	}
+
+	if (arm)
+		this->WaitWritable();
+}
+
+bool DatagramSocket::SendQueued()
+{
+	static constexpr size_t ControlSize = CMSG_SPACE(sizeof(uint16_t));
+
+	while (!this->pending.empty())
+	{
+		size_t count = std::min(this->pending.size(), this->sendMsgs.size());
+		for (size_t i = 0; i < count; ++i)
+		{
+			pending_t &p   = this->pending[i];
+			msghdr &   msg = this->sendMsgs[i].msg_hdr;
+			memset(&msg, 0, sizeof(msghdr));
+
+			this->sendIov[i].iov_base = p.data.data();
+			this->sendIov[i].iov_len  = p.data.size();
+			msg.msg_iov				  = &this->sendIov[i];
+			msg.msg_iovlen			  = 1;
+			// Connected, the kernel knows where to.
+			if (p.addr.sa.sa_family)
+			{
+				msg.msg_name	= &p.addr;
+				msg.msg_namelen = Socket::GetSockLen(p.addr);
+			}
+
+#ifdef UDP_SEGMENT
+			if (p.segment)
+			{
+				char *control = &this->sendControl[i * ControlSize];
+				memset(control, 0, ControlSize);
+				msg.msg_control	= control;
+				msg.msg_controllen = ControlSize;
+
+				cmsghdr *cm  = CMSG_FIRSTHDR(&msg);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type  = UDP_SEGMENT;
+				cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+				memcpy(CMSG_DATA(cm), &p.segment, sizeof(uint16_t));
+			}
+#endif
+		}
+
+		int sent = ::sendmmsg(this->sock_fd, this->sendMsgs.data(), count, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent > 0)
+		{
+			for (int i = 0; i < sent; ++i)
+			{
+				this->pendingBytes -= this->pending.front().data.size();
+				this->pending.pop_front();
+			}
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			break;
+
+		pending_t p = std::move(this->pending.front());
+		this->pending.pop_front();
+		this->pendingBytes -= p.data.size();
+
+		// The device can't checksum for us (EIO) or the kernel didn't like
+		// the segmenting, stop asking and cut it up ourselves.
+		if (p.segment && (errno == EIO || errno == EINVAL))
+		{
+			"[Socket Engine] UDP GSO failed on socket {}, segmenting by hand: {}"_lw(this->sock_fd, strerror(errno));
+			this->gso = -1;
+			for (size_t off = p.data.size(); off > 0;)
+			{
+				size_t n = off % p.segment ? off % p.segment : p.segment;
+				off -= n;
+				pending_t piece;
+				piece.addr	= p.addr;
+				piece.data	= p.data.substr(off, n);
+				piece.segment = 0;
+				this->pendingBytes += n;
+				this->pending.push_front(std::move(piece));
+			}
+			continue;
+		}
+
+		// Too big, no route, ... Like the network dropping it, no reason
+		// to hold the rest up.
+		++this->dropped;
+	}
+
+	return this->pending.empty();
+}
+
+bool DatagramSocket::MultiplexRead()
+{
+	// Reading is cheap next to whatever OnDatagrams() does, but a flood
+	// still shouldn't keep the reactor to ourselves.
+	static constexpr size_t ReadRounds = 16;
+	bool					edge	   = this->HasFlag(MX_EDGETRIGGERED);
+	bool					ok		   = true;
+
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		this->reading = true;
+	}
+
+	for (size_t round = 0; edge || round < ReadRounds; ++round)
+	{
+		for (size_t i = 0; i < this->batchCount; ++i)
+		{
+			msghdr &msg		   = this->recvMsgs[i].msg_hdr;
+			msg.msg_namelen	= sizeof(sockaddr_t);
+			msg.msg_controllen = this->gro ? CMSG_SPACE(sizeof(int)) : 0;
+			msg.msg_flags	  = 0;
+		}
+
+		int count = ::recvmmsg(this->sock_fd, this->recvMsgs.data(), this->batchCount, MSG_DONTWAIT, nullptr);
+		if (count == -1)
+		{
+			// ICMP errors for something we sent, nothing wrong with us.
+			if (errno == EINTR || errno == ECONNREFUSED)
+				continue;
+			break;
+		}
+
+		this->received.clear();
+		for (int i = 0; i < count; ++i)
+		{
+			msghdr &msg = this->recvMsgs[i].msg_hdr;
+			if (msg.msg_flags & MSG_TRUNC)
+			{
+				++this->dropped;
+				continue;
+			}
+
+			const char *data = static_cast<const char *>(msg.msg_iov->iov_base);
+			size_t		len	 = this->recvMsgs[i].msg_len;
+			size_t		seg	 = len;
+#ifdef UDP_GRO
+			for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+				{
+					int size;
+					memcpy(&size, CMSG_DATA(cm), sizeof(int));
+					seg = size > 0 ? size : len;
+				}
+			}
+#endif
+
+			// Empty datagrams are datagrams too.
+			size_t off = 0;
+			do
+			{
+				size_t n = std::min(seg, len - off);
+				this->received.push_back(datagram_t{ this->recvAddrs[i], data + off, n });
+				off += n;
+			} while (off < len);
+		}
+
+		if (!this->received.empty() && !this->OnDatagrams(this->received.data(), this->received.size()))
+		{
+			ok = false;
+			break;
+		}
+
+		// A short batch emptied the socket, no need to go on to EAGAIN.
+		if (static_cast<size_t>(count) < this->batchCount)
+			break;
+	}
+
+	// Everything the batch queued goes out in one go.
+	bool arm;
+	{
+		std::lock_guard<std::mutex> lk(this->sendLock);
+		this->reading = false;
+		arm			  = this->Arm(!this->SendQueued());
+	}
+
+	if (arm)
+		this->WaitWritable();
+	return ok;
+}
+
+bool DatagramSocket::MultiplexWrite()
+{
+	std::lock_guard<std::mutex> lk(this->sendLock);
+	if (!this->SendQueued())
+		this->SetFlag(MX_WRITABLE);
+	else
+		this->armed = false;
+	return true;
+}
+
+bool DatagramSocket::MultiplexErrorQueue()
+{
+	// Clear it, on a UDP socket it's an ICMP error for something we sent
+	// and nothing to close over.
+	int		  optval = 0;
+	socklen_t optlen = sizeof(int);
+	getsockopt(this->sock_fd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+	return true;
+}
@@ -0,0 +1,178 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "SocketMultiplexer.h"
+#include "Flux.h"
+#include "Log.h"
+#include "Exceptions.h"
+#include <cerrno>
+#include <cstring>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <unistd.h>
+
+// The epoll(7) engine. Interest is level-triggered unless the socket sets
+// MX_EDGETRIGGERED, the accept and connect handlers only deal with one
+// thing per event and rely on being told again.
+class EpollEngine : public SocketEngine
+{
+	int epollFD;
+	// Registered for reading, Wake() writes to it.
+	int wakeFD;
+	// Filled in by epoll_wait, doubled whenever a call fills it up.
+	std::vector<epoll_event>	 events;
+	static constexpr size_t MinEvents = 128, MaxEvents = 16384;
+
+	static uint32_t Interest(Socket *s)
+	{
+		// EPOLLRDHUP is level-triggered too, a socket that stopped reading
+		// would hear about a half-close on every wait.
+		uint32_t events = 0;
+		if (s->HasFlag(MX_READABLE))
+			events |= EPOLLIN | EPOLLRDHUP;
+		if (s->HasFlag(MX_WRITABLE))
+			events |= EPOLLOUT;
+		if (s->HasFlag(MX_EDGETRIGGERED))
+			events |= EPOLLET;
+		return events;
+	}
+
+	bool Control(int op, Socket *s)
+	{
+		epoll_event ev;
+		memset(&ev, 0, sizeof(epoll_event));
+		ev.events  = Interest(s);
+		ev.data.fd = s->GetFD();
+		return epoll_ctl(this->epollFD, op, ev.data.fd, &ev) != -1;
+	}
+
+  public:
+	EpollEngine(int fd, int wake) : epollFD(fd), wakeFD(wake), events(MinEvents)
+	{
+		epoll_event ev;
+		memset(&ev, 0, sizeof(epoll_event));
+		ev.events  = EPOLLIN;
+		ev.data.fd = this->wakeFD;
+		epoll_ctl(this->epollFD, EPOLL_CTL_ADD, this->wakeFD, &ev);
+	}
+
+	~EpollEngine()
+	{
+		close(this->wakeFD);
+		close(this->epollFD);
+	}
+
+	socketengine_t Type() const { return SE_EPOLL; }
+
+	bool Add(Socket *s)
+	{
+		if (this->Control(EPOLL_CTL_ADD, s))
+			return true;
+
+		"[Socket Engine] Unable to add socket {} to epoll: {}"_le(s->GetFD(), strerror(errno));
+		return false;
+	}
+
+	bool Remove(Socket *s)
+	{
+		// Closing the fd would drop it too, but the socket may not be closed yet.
+		if (epoll_ctl(this->epollFD, EPOLL_CTL_DEL, s->GetFD(), nullptr) != -1 || errno == ENOENT || errno == EBADF)
+			return true;
+
+		"[Socket Engine] Unable to remove socket {} from epoll: {}"_lw(s->GetFD(), strerror(errno));
+		return false;
+	}
+
+	bool Update(Socket *s)
+	{
+		if (this->Control(EPOLL_CTL_MOD, s))
+			return true;
+
+		"[Socket Engine] Unable to update socket {} in epoll: {}"_lw(s->GetFD(), strerror(errno));
+		return false;
+	}
+
+	void Wake() { eventfd_write(this->wakeFD, 1); }
+
+	void Multiplex(time_t sleep)
+	{
+		int total = epoll_wait(this->epollFD, this->events.data(), static_cast<int>(this->events.size()), sleep < 0 ? -1 : static_cast<int>(sleep * 1000));
+		if (total == -1)
+		{
+			if (errno != EINTR)
+				"[Socket Engine] epoll_wait() failed: {}"_le(strerror(errno));
+			return;
+		}
+
+		for (int i = 0; i < total; ++i)
+		{
+			const epoll_event &ev = this->events[i];
+			if (ev.data.fd == this->wakeFD)
+			{
+				eventfd_t value;
+				eventfd_read(this->wakeFD, &value);
+				continue;
+			}
+
+			// Looked up rather than stored in the event, an earlier handler in
+			// this batch may have deleted the socket.
+			Socket *s = SocketMultiplexer::FindSocket(ev.data.fd, this->reactor);
+			if (!s)
+				continue;
+
+			// A hangup with data still queued is reported as readable first so
+			// the socket gets to read what's left.
+			bool error = (ev.events & EPOLLERR) || (ev.events & (EPOLLHUP | EPOLLIN)) == EPOLLHUP;
+			SocketMultiplexer::Dispatch(s, ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP), ev.events & EPOLLOUT, error);
+		}
+
+		if (static_cast<size_t>(total) == this->events.size() && this->events.size() < MaxEvents)
+			this->events.resize(this->events.size() * 2);
+	}
+};
+
+SocketEngine *CreateEpollEngine()
+{
+	int fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd == -1)
+	{
+		"[Socket Engine] Unable to create epoll instance: {}"_le(strerror(errno));
+		return nullptr;
+	}
+
+	int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake == -1)
+	{
+		"[Socket Engine] Unable to create eventfd: {}"_le(strerror(errno));
+		close(fd);
+		return nullptr;
+	}
+
+	return new EpollEngine(fd, wake);
+}
+
+#else
+SocketEngine *CreateEpollEngine() { return nullptr; }
+#endif
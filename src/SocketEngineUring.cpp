@@ -0,0 +1,588 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "SocketMultiplexer.h"
+#include "Flux.h"
+#include "Log.h"
+#include <cerrno>
+#include <cstring>
+#ifdef HAVE_LINUX_IO_URING_H
+# include <algorithm>
+# include <atomic>
+# include <csignal>
+# include <thread>
+# include <linux/io_uring.h>
+# include <poll.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+
+// No liburing, these three are all we need.
+static int UringSetup(unsigned entries, io_uring_params *p) { return syscall(__NR_io_uring_setup, entries, p); }
+static int UringEnter(int fd, unsigned submit, unsigned complete, unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, arg, argsz);
+}
+static int UringRegister(int fd, unsigned op, void *arg, unsigned nargs) { return syscall(__NR_io_uring_register, fd, op, arg, nargs); }
+
+// What a request is for, kept in the low bits of its user_data.
+typedef enum
+{
+	UO_INTERNAL, // Cancels and wakeups, nothing to do when they complete
+	UO_ACCEPT,   // Multishot accept for listening sockets
+	UO_RECV,	 // Multishot recv into the provided buffer ring
+	UO_POLLIN,   // Multishot poll for everything else
+	UO_POLLOUT,  // One-shot poll, writability is one-shot anyway
+	UO_MAX
+} uringop_t;
+
+typedef struct
+{
+	bool live;
+	bool checked; // listening/stream below have been worked out
+	bool listening;
+	bool stream;
+	// Bumped by every request, add and remove. Completions from before
+	// addSeq are for an older socket that had the same fd.
+	uint32_t seq, addSeq;
+	// user_data of the request we have in flight for each op, 0 if none.
+	uint64_t armed[UO_MAX];
+} uringfd_t;
+
+// The io_uring engine. Reads are multishot recvs into a ring of provided
+// buffers, the data is handed to the socket (Socket::Received) so Read()
+// still works, listening sockets get a multishot accept and everything
+// else a multishot poll. A busy socket costs no syscalls at all, the
+// loop's one io_uring_enter both submits and waits.
+//
+// Only the thread calling Multiplex() arms requests, since it has to be
+// able to look at the socket. Everyone else queues the fd and pokes the
+// ring with a NOP if the loop is asleep.
+class UringEngine : public SocketEngine
+{
+	static constexpr unsigned Entries = 1024, CQEntries = 16384;
+	static constexpr unsigned BufferCount = 1024, BufferSize = 4096;
+
+	int ringFD;
+	io_uring_params params;
+
+	void *ring, *sqeRing;
+	size_t ringSize;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned  sqLocalTail;
+	unsigned *cqHead, *cqTail, *cqMask;
+	io_uring_sqe *sqes;
+	io_uring_cqe *cqes;
+
+	// Not io_uring_buf_ring, its flexible array lands 8 bytes late in C++.
+	// The ring's tail lives in the first entry's resv.
+	io_uring_buf *bufRing;
+	char *		  buffers;
+	uint16_t		   bufTail;
+	// Cleared if the kernel predates multishot recv (6.0), we poll instead.
+	bool multishotRecv;
+
+	// Guards the submission queue, fds and changed.
+	std::mutex			   ringLock;
+	std::vector<uringfd_t> fds;
+	// fds to (re)arm on the next Multiplex()
+	std::vector<int> changed;
+	// fds with data in Socket::readBuffer, they are dispatched again until
+	// they read it all like level-triggered epoll would.
+	std::vector<int>			 buffered;
+	std::atomic<std::thread::id> loopThread;
+
+	typedef struct
+	{
+		int		  fd;
+		uringop_t op;
+		int		  res;
+		uint32_t  flags;
+	} completion_t;
+	std::vector<completion_t> completions;
+
+	uringfd_t &State(int fd)
+	{
+		if (static_cast<size_t>(fd) >= this->fds.size())
+			this->fds.resize(std::max<size_t>(fd + 1, this->fds.size() * 2));
+		return this->fds[fd];
+	}
+
+	// Must hold ringLock. Entries aren't visible to the kernel until Flush().
+	io_uring_sqe *NextSQE()
+	{
+		while (this->sqLocalTail - std::atomic_ref<unsigned>(*this->sqHead).load(std::memory_order_acquire) >= this->params.sq_entries)
+			this->Submit();
+
+		io_uring_sqe *sqe = &this->sqes[this->sqLocalTail++ & *this->sqMask];
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		return sqe;
+	}
+
+	// Must hold ringLock, returns how many entries are waiting to be submitted.
+	unsigned Flush()
+	{
+		std::atomic_ref<unsigned>(*this->sqTail).store(this->sqLocalTail, std::memory_order_release);
+		return this->sqLocalTail - std::atomic_ref<unsigned>(*this->sqHead).load(std::memory_order_acquire);
+	}
+
+	// Must hold ringLock.
+	void Submit()
+	{
+		unsigned submit = this->Flush();
+		if (submit && UringEnter(this->ringFD, submit, 0, 0, nullptr, 0) == -1 && errno != EINTR && errno != EBUSY)
+			"[Socket Engine] Unable to submit to io_uring: {}"_le(strerror(errno));
+	}
+
+	// Must hold ringLock. Gets the loop to pick up what we queued unless
+	// we're the loop.
+	void Poke()
+	{
+		if (this->loopThread.load(std::memory_order_relaxed) == std::this_thread::get_id())
+			return;
+
+		io_uring_sqe *sqe = this->NextSQE();
+		sqe->opcode		  = IORING_OP_NOP;
+		this->Submit();
+	}
+
+	void Arm(int fd, uringfd_t &st, uringop_t op)
+	{
+		io_uring_sqe *sqe = this->NextSQE();
+		sqe->fd			  = fd;
+		sqe->user_data	= static_cast<uint64_t>(++st.seq) << 32 | static_cast<uint64_t>(fd) << 3 | op;
+		st.armed[op]	  = sqe->user_data;
+
+		switch (op)
+		{
+			case UO_ACCEPT:
+				sqe->opcode		  = IORING_OP_ACCEPT;
+				sqe->ioprio		  = IORING_ACCEPT_MULTISHOT;
+				sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+				break;
+			case UO_RECV:
+				sqe->opcode	= IORING_OP_RECV;
+				sqe->ioprio	= IORING_RECV_MULTISHOT;
+				sqe->flags	 = IOSQE_BUFFER_SELECT;
+				sqe->buf_group = 0;
+				break;
+			case UO_POLLIN:
+				sqe->opcode		   = IORING_OP_POLL_ADD;
+				sqe->len		   = IORING_POLL_ADD_MULTI;
+				sqe->poll32_events = POLLIN | POLLRDHUP;
+				break;
+			case UO_POLLOUT:
+				sqe->opcode		   = IORING_OP_POLL_ADD;
+				sqe->poll32_events = POLLOUT;
+				break;
+			default:
+				break;
+		}
+	}
+
+	void Cancel(uringfd_t &st, uringop_t op)
+	{
+		io_uring_sqe *sqe = this->NextSQE();
+		sqe->opcode		  = IORING_OP_ASYNC_CANCEL;
+		sqe->fd			  = -1;
+		sqe->addr		  = st.armed[op];
+		st.armed[op]	  = 0;
+	}
+
+	void Recycle(uint16_t bid)
+	{
+		io_uring_buf *buf = &this->bufRing[this->bufTail & (BufferCount - 1)];
+		buf->addr		  = reinterpret_cast<uint64_t>(this->buffers + static_cast<size_t>(bid) * BufferSize);
+		buf->len		  = BufferSize;
+		buf->bid		  = bid;
+		std::atomic_ref<uint16_t>(this->bufRing[0].resv).store(++this->bufTail, std::memory_order_release);
+	}
+
+	// Work out what the socket wants and bring the requests in line with it.
+	void Apply(int fd)
+	{
+		Socket *s = SocketMultiplexer::FindSocket(fd, this->reactor);
+		if (!s || s->HasFlag(SS_DEAD))
+			return;
+
+		bool checked, listening = false, stream = false;
+		{
+			std::lock_guard<std::mutex> lk(this->ringLock);
+			checked = this->State(fd).checked;
+		}
+
+		if (!checked)
+		{
+			int		  type = 0, domain = 0;
+			socklen_t len  = sizeof(int);
+			getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+			len = sizeof(int);
+			getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+			listening = dynamic_cast<ListeningSocket *>(s) != nullptr;
+			// Fds passed over UNIX sockets only come with recvmsg(), leave
+			// reading those to the socket.
+			stream = type == SOCK_STREAM && domain != AF_UNIX;
+		}
+
+		std::lock_guard<std::mutex> lk(this->ringLock);
+		uringfd_t &					st = this->State(fd);
+		if (!st.live)
+			return;
+		if (!st.checked)
+		{
+			st.checked   = true;
+			st.listening = listening;
+			st.stream	= stream;
+		}
+
+		unsigned want = 0;
+		if (s->HasFlag(MX_READABLE))
+			want |= 1 << (st.listening ? UO_ACCEPT : st.stream && this->multishotRecv ? UO_RECV : UO_POLLIN);
+		if (s->HasFlag(MX_WRITABLE))
+			want |= 1 << UO_POLLOUT;
+
+		for (int op = UO_ACCEPT; op < UO_MAX; ++op)
+		{
+			bool wanted = want & (1 << op);
+			if (wanted && !st.armed[op])
+				this->Arm(fd, st, static_cast<uringop_t>(op));
+			else if (!wanted && st.armed[op])
+				this->Cancel(st, static_cast<uringop_t>(op));
+		}
+	}
+
+	// Pull everything off the completion queue, dropping anything for
+	// sockets that have since gone away.
+	void Harvest()
+	{
+		std::lock_guard<std::mutex> lk(this->ringLock);
+
+		unsigned head = *this->cqHead, tail = std::atomic_ref<unsigned>(*this->cqTail).load(std::memory_order_acquire);
+		for (; head != tail; ++head)
+		{
+			const io_uring_cqe &cqe = this->cqes[head & *this->cqMask];
+			if (!cqe.user_data)
+				continue;
+
+			int		  fd  = static_cast<uint32_t>(cqe.user_data) >> 3;
+			uringop_t op  = static_cast<uringop_t>(cqe.user_data & 7);
+			uint32_t  seq = cqe.user_data >> 32;
+
+			uringfd_t &st = this->State(fd);
+			if (!st.live || seq < st.addSeq)
+			{
+				if (cqe.flags & IORING_CQE_F_BUFFER)
+					this->Recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+				continue;
+			}
+
+			// The request is done, arm it again if the socket still wants it.
+			if (!(cqe.flags & IORING_CQE_F_MORE) && st.armed[op] == cqe.user_data)
+			{
+				st.armed[op] = 0;
+				if (op == UO_RECV && cqe.res == -EINVAL)
+					this->multishotRecv = false;
+				// Not connected yet, wait for Connect() to update us.
+				if (cqe.res != -ENOTCONN)
+					this->changed.push_back(fd);
+			}
+
+			this->completions.push_back({ fd, op, cqe.res, cqe.flags });
+		}
+
+		std::atomic_ref<unsigned>(*this->cqHead).store(head, std::memory_order_release);
+	}
+
+	void Process(const completion_t &c)
+	{
+		Socket *s = SocketMultiplexer::FindSocket(c.fd, this->reactor);
+
+		switch (c.op)
+		{
+			case UO_ACCEPT:
+			{
+				if (c.res < 0)
+				{
+					if (c.res != -ECANCELED)
+						"[Socket Engine] Unable to accept connection: {}"_lw(strerror(-c.res));
+					break;
+				}
+
+				ListeningSocket *ls = dynamic_cast<ListeningSocket *>(s);
+				if (!ls)
+				{
+					close(c.res);
+					break;
+				}
+
+				sockaddr_t addr;
+				socklen_t  size = sizeof(sockaddr_t);
+				memset(&addr, 0, sizeof(sockaddr_t));
+				getpeername(c.res, &addr.sa, &size);
+				ls->Accepted(c.res, addr);
+				break;
+			}
+			case UO_RECV:
+				if (c.flags & IORING_CQE_F_BUFFER)
+				{
+					uint16_t bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+					if (s && c.res > 0)
+						s->Received(this->buffers + static_cast<size_t>(bid) * BufferSize, c.res);
+
+					std::lock_guard<std::mutex> lk(this->ringLock);
+					this->Recycle(bid);
+				}
+
+				if (!s)
+					break;
+				// 0 is the peer hanging up, let the socket find out from Read().
+				if (c.res >= 0)
+					this->buffered.push_back(c.fd);
+				else if (c.res != -ENOBUFS && c.res != -ECANCELED && c.res != -ENOTCONN && c.res != -EINVAL)
+					SocketMultiplexer::Dispatch(s, false, false, true);
+				break;
+			case UO_POLLIN:
+			case UO_POLLOUT:
+				if (!s || c.res < 0)
+					break;
+
+				SocketMultiplexer::Dispatch(s,
+											c.res & (POLLIN | POLLRDHUP | POLLHUP),
+											c.res & POLLOUT,
+											(c.res & POLLERR) || (c.res & (POLLHUP | POLLIN)) == POLLHUP);
+				break;
+			default:
+				break;
+		}
+	}
+
+  public:
+	UringEngine() : ringFD(-1), ring(MAP_FAILED), sqeRing(MAP_FAILED), sqLocalTail(0), bufRing(nullptr), buffers(nullptr), bufTail(0), multishotRecv(true) {}
+
+	~UringEngine()
+	{
+		if (this->bufRing)
+		{
+			io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(io_uring_buf_reg));
+			UringRegister(this->ringFD, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+			munmap(this->bufRing, BufferCount * sizeof(io_uring_buf));
+		}
+		delete[] this->buffers;
+
+		if (this->sqeRing != MAP_FAILED)
+			munmap(this->sqeRing, this->params.sq_entries * sizeof(io_uring_sqe));
+		if (this->ring != MAP_FAILED)
+			munmap(this->ring, this->ringSize);
+		if (this->ringFD != -1)
+			close(this->ringFD);
+	}
+
+	bool Setup()
+	{
+		memset(&this->params, 0, sizeof(io_uring_params));
+		this->params.flags		= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+		this->params.cq_entries = CQEntries;
+
+		this->ringFD = UringSetup(Entries, &this->params);
+		if (this->ringFD == -1)
+			return false;
+
+		// We need the timeout argument to io_uring_enter (5.11) and the
+		// single mmap layout.
+		if (!(this->params.features & IORING_FEAT_EXT_ARG) || !(this->params.features & IORING_FEAT_SINGLE_MMAP))
+			return false;
+
+		this->ringSize = std::max(this->params.sq_off.array + this->params.sq_entries * sizeof(unsigned),
+								  this->params.cq_off.cqes + this->params.cq_entries * sizeof(io_uring_cqe));
+		this->ring	 = mmap(nullptr, this->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFD, IORING_OFF_SQ_RING);
+		this->sqeRing  = mmap(nullptr,
+							  this->params.sq_entries * sizeof(io_uring_sqe),
+							  PROT_READ | PROT_WRITE,
+							  MAP_SHARED | MAP_POPULATE,
+							  this->ringFD,
+							  IORING_OFF_SQES);
+		if (this->ring == MAP_FAILED || this->sqeRing == MAP_FAILED)
+			return false;
+
+		char *ring	= static_cast<char *>(this->ring);
+		this->sqHead  = reinterpret_cast<unsigned *>(ring + this->params.sq_off.head);
+		this->sqTail  = reinterpret_cast<unsigned *>(ring + this->params.sq_off.tail);
+		this->sqMask  = reinterpret_cast<unsigned *>(ring + this->params.sq_off.ring_mask);
+		this->sqArray = reinterpret_cast<unsigned *>(ring + this->params.sq_off.array);
+		this->cqHead  = reinterpret_cast<unsigned *>(ring + this->params.cq_off.head);
+		this->cqTail  = reinterpret_cast<unsigned *>(ring + this->params.cq_off.tail);
+		this->cqMask  = reinterpret_cast<unsigned *>(ring + this->params.cq_off.ring_mask);
+		this->cqes	= reinterpret_cast<io_uring_cqe *>(ring + this->params.cq_off.cqes);
+		this->sqes	= static_cast<io_uring_sqe *>(this->sqeRing);
+
+		// SQEs are always used in ring order.
+		for (unsigned i = 0; i < this->params.sq_entries; ++i)
+			this->sqArray[i] = i;
+
+		// Provided buffer rings are 5.19, as is multishot accept, so this
+		// doubles as the version check.
+		void *bufRing = mmap(nullptr, BufferCount * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (bufRing == MAP_FAILED)
+			return false;
+
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(io_uring_buf_reg));
+		reg.ring_addr	= reinterpret_cast<uint64_t>(bufRing);
+		reg.ring_entries = BufferCount;
+		reg.bgid		 = 0;
+		if (UringRegister(this->ringFD, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		{
+			munmap(bufRing, BufferCount * sizeof(io_uring_buf));
+			return false;
+		}
+
+		this->bufRing = static_cast<io_uring_buf *>(bufRing);
+		this->buffers = new char[static_cast<size_t>(BufferCount) * BufferSize];
+		for (unsigned i = 0; i < BufferCount; ++i)
+			this->Recycle(i);
+
+		return true;
+	}
+
+	socketengine_t Type() const { return SE_IOURING; }
+
+	bool Add(Socket *s)
+	{
+		std::lock_guard<std::mutex> lk(this->ringLock);
+		uringfd_t &					st  = this->State(s->GetFD());
+		uint32_t					seq = st.seq + 1;
+
+		// The socket isn't fully constructed yet so the requests get armed
+		// from the loop.
+		memset(&st, 0, sizeof(uringfd_t));
+		st.live = true;
+		st.seq = st.addSeq = seq;
+		this->changed.push_back(s->GetFD());
+		this->Poke();
+		return true;
+	}
+
+	bool Remove(Socket *s)
+	{
+		// Cancelled by user_data rather than fd since the fd may be reused
+		// before the cancellation goes through.
+		std::lock_guard<std::mutex> lk(this->ringLock);
+		uringfd_t &					st = this->State(s->GetFD());
+		for (int op = UO_ACCEPT; op < UO_MAX; ++op)
+			if (st.armed[op])
+				this->Cancel(st, static_cast<uringop_t>(op));
+
+		st.live = false;
+		st.seq++;
+		this->Poke();
+		return true;
+	}
+
+	bool Update(Socket *s)
+	{
+		std::lock_guard<std::mutex> lk(this->ringLock);
+		this->changed.push_back(s->GetFD());
+		this->Poke();
+		return true;
+	}
+
+	void Wake()
+	{
+		std::lock_guard<std::mutex> lk(this->ringLock);
+		io_uring_sqe *				sqe = this->NextSQE();
+		sqe->opcode						= IORING_OP_NOP;
+		this->Submit();
+	}
+
+	void Multiplex(time_t sleep)
+	{
+		this->loopThread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+
+		std::vector<int> apply;
+		{
+			std::lock_guard<std::mutex> lk(this->ringLock);
+			apply.swap(this->changed);
+		}
+		std::sort(apply.begin(), apply.end());
+		apply.erase(std::unique(apply.begin(), apply.end()), apply.end());
+		for (int fd : apply)
+			this->Apply(fd);
+
+		// Submitting and waiting is one syscall, made without the lock so
+		// other threads can still queue. Don't sleep while a socket still has
+		// data to read.
+		unsigned submit;
+		{
+			std::lock_guard<std::mutex> lk(this->ringLock);
+			submit = this->Flush();
+		}
+
+		__kernel_timespec	  ts  = { sleep, 0 };
+		io_uring_getevents_arg arg = { 0, _NSIG / 8, 0, sleep < 0 ? 0 : reinterpret_cast<uint64_t>(&ts) };
+		unsigned			   wait = this->buffered.empty() ? 1 : 0;
+		if (UringEnter(this->ringFD, submit, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1 && errno != ETIME &&
+			errno != EINTR && errno != EBUSY)
+			"[Socket Engine] io_uring_enter() failed: {}"_le(strerror(errno));
+
+		this->Harvest();
+		for (const completion_t &c : this->completions)
+			this->Process(c);
+		this->completions.clear();
+
+		// Sockets that got data (or were left some) read until they've had it all.
+		std::vector<int> ready;
+		ready.swap(this->buffered);
+		std::sort(ready.begin(), ready.end());
+		ready.erase(std::unique(ready.begin(), ready.end()), ready.end());
+		for (int fd : ready)
+		{
+			Socket *s = SocketMultiplexer::FindSocket(fd, this->reactor);
+			if (!s)
+				continue;
+
+			size_t before = s->Buffered();
+			SocketMultiplexer::Dispatch(s, true, false, false);
+			// Only keep going while the socket actually reads, otherwise a
+			// socket that ignores its input would keep us spinning.
+			if (!s->HasFlag(SS_DEAD) && s->Buffered() && s->Buffered() < before)
+				this->buffered.push_back(fd);
+		}
+	}
+};
+
+SocketEngine *CreateUringEngine()
+{
+	UringEngine *engine = new UringEngine();
+	if (engine->Setup())
+		return engine;
+
+	"[Socket Engine] Unable to set up io_uring: {}"_lw(strerror(errno));
+	delete engine;
+	return nullptr;
+}
+
+#else
+SocketEngine *CreateUringEngine() { return nullptr; }
+#endif
@@ -24,30 +24,297 @@
 
 #include "SocketMultiplexer.h"
 #include "Flux.h"
+#include "Log.h"
+#include "Exceptions.h"
+#include <algorithm>
 
-/**
- * This file is entirely a stub to make sure that the application links correctly.
- * These are actually implemented in the socket engine modules.
- */
+std::atomic<std::atomic<Socket *> *>		SocketMultiplexer::Sockets[SocketMultiplexer::SocketChunks];
+std::mutex									SocketMultiplexer::SocketLock;
+std::vector<std::unique_ptr<Reactor>>		SocketMultiplexer::Reactors;
+thread_local int							SocketMultiplexer::Current = -1;
+thread_local std::vector<int>				SocketMultiplexer::Dead;
+
+std::atomic<Socket *> *SocketMultiplexer::Slot(int sock_fd, bool create)
+{
+	if (sock_fd < 0 || static_cast<size_t>(sock_fd) >= SocketChunk * SocketChunks)
+		return nullptr;
+
+	std::atomic<std::atomic<Socket *> *> &chunk = SocketMultiplexer::Sockets[sock_fd / SocketChunk];
+	std::atomic<Socket *> *				  slots = chunk.load(std::memory_order_acquire);
+	if (!slots && create)
+	{
+		std::lock_guard<std::mutex> lk(SocketMultiplexer::SocketLock);
+		slots = chunk.load(std::memory_order_relaxed);
+		if (!slots)
+		{
+			slots = new std::atomic<Socket *>[SocketChunk]();
+			chunk.store(slots, std::memory_order_release);
+		}
+	}
+
+	return slots ? &slots[sock_fd % SocketChunk] : nullptr;
+}
 
 Socket *SocketMultiplexer::FindSocket(int sock_fd)
 {
-	for (auto it : SocketMultiplexer::Sockets)
+	std::atomic<Socket *> *slot = SocketMultiplexer::Slot(sock_fd, false);
+	return slot ? slot->load(std::memory_order_acquire) : nullptr;
+}
+
+Socket *SocketMultiplexer::FindSocket(int sock_fd, unsigned reactor)
+{
+	Socket *s = SocketMultiplexer::FindSocket(sock_fd);
+	return s && s->reactor == reactor ? s : nullptr;
+}
+
+static SocketEngine *CreateEngine(socketengine_t type)
+{
+	SocketEngine *engine = type == SE_IOURING ? CreateUringEngine() : nullptr;
+	if (!engine)
+	{
+		if (type != SE_EPOLL)
+			"[Socket Engine] io_uring is not available, using epoll"_lw();
+		engine = CreateEpollEngine();
+	}
+	if (!engine)
+		throw SocketException("No socket engine is available");
+	return engine;
+}
+
+void SocketMultiplexer::RunReactor(Reactor *r)
+{
+	SocketMultiplexer::Current = r->id;
+
+	while (!r->stop.load(std::memory_order_relaxed))
+	{
+		r->engine->Multiplex(-1);
+		SocketMultiplexer::Reap();
+		SocketMultiplexer::RunJobs(r);
+	}
+}
+
+void SocketMultiplexer::RunJobs(Reactor *r)
+{
+	std::vector<function_t> jobs;
 	{
-		if (it->GetFD() == sock_fd)
-			return it;
+		std::lock_guard<std::mutex> lk(r->jobLock);
+		jobs.swap(r->jobs);
 	}
-	return nullptr;
+
+	for (auto &job : jobs)
+		job();
+}
+
+void SocketMultiplexer::RunOn(unsigned reactor, function_t &&func)
+{
+	if (SocketMultiplexer::Reactors.empty())
+		SocketMultiplexer::Start(SE_EPOLL, 1);
+
+	Reactor *r = SocketMultiplexer::Reactors.at(reactor).get();
+	if (SocketMultiplexer::Current == static_cast<int>(reactor))
+	{
+		func();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(r->jobLock);
+		r->jobs.push_back(std::move(func));
+	}
+	r->engine->Wake();
+}
+
+void SocketMultiplexer::StopReactors()
+{
+	for (auto &r : SocketMultiplexer::Reactors)
+	{
+		r->stop = true;
+		r->engine->Wake();
+	}
+	for (auto &r : SocketMultiplexer::Reactors)
+		if (r->thread.joinable())
+			r->thread.join();
 }
 
 // Initalizers
-void SocketMultiplexer::Initialize() {}
-void SocketMultiplexer::Terminate() {}
+void SocketMultiplexer::Initialize(socketengine_t type, unsigned count)
+{
+	// Whoever sets us up runs reactor 0.
+	SocketMultiplexer::Current = 0;
+	SocketMultiplexer::Start(type, count);
+}
+
+void SocketMultiplexer::Start(socketengine_t type, unsigned count)
+{
+	count = std::max(count, 1u);
+	if (!SocketMultiplexer::Reactors.empty() && SocketMultiplexer::Reactors.size() == count &&
+		SocketMultiplexer::Reactors[0]->engine->Type() == type)
+		return;
+
+	SocketMultiplexer::StopReactors();
+
+	std::vector<std::unique_ptr<Reactor>> reactors;
+	for (unsigned i = 0; i < count; ++i)
+		reactors.emplace_back(new Reactor(i, CreateEngine(type)));
+
+	// Move anything created before we were called over to the new engines,
+	// sockets on reactors that are going away end up on reactor 0.
+	{
+		std::lock_guard<std::mutex> lk(SocketMultiplexer::SocketLock);
+		for (auto &chunk : SocketMultiplexer::Sockets)
+		{
+			std::atomic<Socket *> *slots = chunk.load(std::memory_order_relaxed);
+			for (size_t i = 0; slots && i < SocketChunk; ++i)
+			{
+				Socket *s = slots[i].load(std::memory_order_relaxed);
+				if (!s)
+					continue;
+				if (s->reactor < SocketMultiplexer::Reactors.size())
+					SocketMultiplexer::Reactors[s->reactor]->engine->Remove(s);
+				if (s->reactor >= count)
+					s->reactor = 0;
+				reactors[s->reactor]->engine->Add(s);
+			}
+		}
+	}
+
+	SocketMultiplexer::Reactors.swap(reactors);
+	for (unsigned i = 1; i < count; ++i)
+		SocketMultiplexer::Reactors[i]->thread = std::thread(&SocketMultiplexer::RunReactor, SocketMultiplexer::Reactors[i].get());
+}
+
+void SocketMultiplexer::Terminate()
+{
+	SocketMultiplexer::StopReactors();
+
+	// Sockets take themselves out of the table in their destructors.
+	for (auto &chunk : SocketMultiplexer::Sockets)
+	{
+		std::atomic<Socket *> *slots = chunk.load(std::memory_order_relaxed);
+		for (size_t i = 0; slots && i < SocketChunk; ++i)
+			delete slots[i].load(std::memory_order_relaxed);
+
+		delete[] slots;
+		chunk = nullptr;
+	}
+
+	SocketMultiplexer::Reactors.clear();
+	SocketMultiplexer::Dead.clear();
+}
+
+socketengine_t SocketMultiplexer::EngineType()
+{
+	if (SocketMultiplexer::Reactors.empty())
+		SocketMultiplexer::Start(SE_EPOLL, 1);
+	return SocketMultiplexer::Reactors[0]->engine->Type();
+}
+
+unsigned SocketMultiplexer::ReactorCount()
+{
+	if (SocketMultiplexer::Reactors.empty())
+		SocketMultiplexer::Start(SE_EPOLL, 1);
+	return SocketMultiplexer::Reactors.size();
+}
 
 // Sockets interact with these functions.
-bool SocketMultiplexer::AddSocket(Socket *s) { return false; }
-bool SocketMultiplexer::RemoveSocket(Socket *s) { return false; }
-bool SocketMultiplexer::UpdateSocket(Socket *s) { return false; }
+bool SocketMultiplexer::AddSocket(Socket *s)
+{
+	if (SocketMultiplexer::Reactors.empty())
+		SocketMultiplexer::Start(SE_EPOLL, 1);
+
+	std::atomic<Socket *> *slot = SocketMultiplexer::Slot(s->GetFD(), true);
+	if (!slot)
+		return false;
+
+	int current = SocketMultiplexer::Current;
+	s->reactor  = current > 0 && static_cast<size_t>(current) < SocketMultiplexer::Reactors.size() ? current : 0;
+
+	// In the table first, the engine may hand us events right away.
+	slot->store(s, std::memory_order_release);
+	if (SocketMultiplexer::Reactors[s->reactor]->engine->Add(s))
+		return true;
+
+	slot->store(nullptr, std::memory_order_release);
+	return false;
+}
+
+bool SocketMultiplexer::RemoveSocket(Socket *s)
+{
+	std::atomic<Socket *> *slot = SocketMultiplexer::Slot(s->GetFD(), false);
+	Socket *			   expected = s;
+	if (!slot || !slot->compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+		return false;
+
+	return SocketMultiplexer::Reactors[s->reactor]->engine->Remove(s);
+}
+
+bool SocketMultiplexer::UpdateSocket(Socket *s)
+{
+	if (SocketMultiplexer::FindSocket(s->GetFD()) != s)
+		return false;
+	return SocketMultiplexer::Reactors[s->reactor]->engine->Update(s);
+}
 
 // This is called in the event loop to slow the program down and process sockets.
-void SocketMultiplexer::Multiplex(time_t sleep) {}
+void SocketMultiplexer::Multiplex(time_t sleep)
+{
+	if (SocketMultiplexer::Reactors.empty())
+		SocketMultiplexer::Start(SE_EPOLL, 1);
+
+	SocketMultiplexer::Current = 0;
+	SocketMultiplexer::Reactors[0]->engine->Multiplex(sleep);
+	SocketMultiplexer::Reap();
+	SocketMultiplexer::RunJobs(SocketMultiplexer::Reactors[0].get());
+}
+
+void SocketMultiplexer::Dispatch(Socket *s, bool readable, bool writable, bool error)
+{
+	if (s->HasFlag(SS_DEAD))
+		;
+	else if (error && !s->MultiplexErrorQueue())
+	{
+		s->MultiplexError();
+		s->SetFlag(SS_DEAD);
+	}
+	else
+	{
+		// Writability is one-shot, a socket that still has something to send
+		// sets MX_WRITABLE again. Otherwise every idle socket would come back
+		// from every wait.
+		if (writable)
+			s->RemoveFlag(MX_WRITABLE);
+
+		bool connecting = s->HasFlag(SS_CONNECTING);
+		if (s->MultiplexEvent())
+		{
+			if (readable && !s->MultiplexRead())
+				s->SetFlag(SS_DEAD);
+			if (writable && !s->HasFlag(SS_DEAD) && !s->MultiplexWrite())
+				s->SetFlag(SS_DEAD);
+
+			// After the handlers, buffered sockets have just filled up.
+			s->NotifyWaiters(readable, writable);
+		}
+		// A connect() just finished, send whatever was queued while it ran.
+		else if (connecting && writable && s->HasFlag(SS_CONNECTED) && !s->HasFlag(SS_DEAD) && !s->MultiplexWrite())
+			s->SetFlag(SS_DEAD);
+
+		if (writable && !s->HasFlag(SS_DEAD) && !s->HasFlag(MX_WRITABLE))
+			SocketMultiplexer::UpdateSocket(s);
+	}
+
+	if (s->HasFlag(SS_DEAD))
+		SocketMultiplexer::Dead.push_back(s->GetFD());
+}
+
+void SocketMultiplexer::Reap()
+{
+	// Reap dead sockets by fd, the same socket can show up twice in a batch.
+	unsigned reactor = std::max(SocketMultiplexer::Current, 0);
+	for (int fd : SocketMultiplexer::Dead)
+	{
+		if (Socket *s = SocketMultiplexer::FindSocket(fd, reactor); s && s->HasFlag(SS_DEAD))
+			delete s;
+	}
+	SocketMultiplexer::Dead.clear();
+}
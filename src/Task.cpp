@@ -0,0 +1,208 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "Task.h"
+#include <mutex>
+#include <vector>
+
+// The slab belonging to this thread, null until the first allocation and
+// again once the thread has started exiting.
+static thread_local TaskSlab *currentSlab = nullptr;
+static thread_local bool slabExited = false;
+
+// Slabs of threads that have exited, handed to new threads so the headers
+// aren't leaked every time the pool retires and respawns a worker.
+static std::mutex orphanLock;
+static std::vector<TaskSlab *> orphans;
+
+struct TaskSlabHolder
+{
+	~TaskSlabHolder()
+	{
+		if (currentSlab)
+			TaskSlab::ThreadExit(currentSlab);
+		currentSlab = nullptr;
+		slabExited = true;
+	}
+};
+
+static thread_local TaskSlabHolder slabHolder;
+
+TaskSlab::TaskSlab()
+{
+	for (size_t i = 0; i < NumClasses; ++i)
+	{
+		this->local[i].head = nullptr;
+		this->local[i].count = 0;
+		this->remote[i].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+TaskSlab::~TaskSlab() {}
+
+TaskSlab::block_t *TaskSlab::Closed()
+{
+	// Marks the remote list of a slab whose thread exited, blocks sent
+	// to it are freed right away instead.
+	static block_t closed;
+	return &closed;
+}
+
+TaskSlab *TaskSlab::Current()
+{
+	if (currentSlab || slabExited)
+		return currentSlab;
+
+	{
+		std::lock_guard<std::mutex> lk(orphanLock);
+		if (!orphans.empty())
+		{
+			currentSlab = orphans.back();
+			orphans.pop_back();
+			for (size_t i = 0; i < NumClasses; ++i)
+				currentSlab->remote[i].store(nullptr, std::memory_order_release);
+		}
+	}
+
+	if (!currentSlab)
+		currentSlab = new TaskSlab;
+
+	// Touch the holder so its destructor runs when this thread exits.
+	(void)&slabHolder;
+	return currentSlab;
+}
+
+void TaskSlab::ThreadExit(TaskSlab *slab)
+{
+	for (size_t i = 0; i < NumClasses; ++i)
+	{
+		for (block_t *b = slab->local[i].head; b;)
+		{
+			block_t *next = b->next;
+			::operator delete(b);
+			b = next;
+		}
+		slab->local[i].head = nullptr;
+		slab->local[i].count = 0;
+
+		for (block_t *b = slab->remote[i].exchange(Closed(), std::memory_order_acquire); b;)
+		{
+			block_t *next = b->next;
+			::operator delete(b);
+			b = next;
+		}
+	}
+
+	std::lock_guard<std::mutex> lk(orphanLock);
+	orphans.push_back(slab);
+}
+
+void TaskSlab::PushRemote(block_t *b)
+{
+	std::atomic<block_t *> &head = this->remote[b->sizeclass];
+	block_t *old = head.load(std::memory_order_relaxed);
+	do
+	{
+		if (old == Closed())
+		{
+			::operator delete(b);
+			return;
+		}
+		b->next = old;
+	} while (!head.compare_exchange_weak(old, b, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void *TaskSlab::Allocate(size_t size)
+{
+	size_t total = size + sizeof(block_t);
+	size_t cls = 0, blocksz = MinBlock;
+	while (blocksz < total && cls < NumClasses)
+	{
+		blocksz <<= 1;
+		cls++;
+	}
+
+	if (cls == NumClasses)
+	{
+		// Too big to be worth caching.
+		block_t *b = static_cast<block_t *>(::operator new(total));
+		b->owner = nullptr;
+		b->sizeclass = NumClasses;
+		return b + 1;
+	}
+
+	TaskSlab *slab = Current();
+	if (slab)
+	{
+		freelist_t &fl = slab->local[cls];
+		if (!fl.head)
+		{
+			// Take back everything the other threads freed for us.
+			fl.head = slab->remote[cls].exchange(nullptr, std::memory_order_acquire);
+			for (block_t *b = fl.head; b; b = b->next)
+				fl.count++;
+		}
+
+		if (fl.head)
+		{
+			block_t *b = fl.head;
+			fl.head = b->next;
+			fl.count--;
+			return b + 1;
+		}
+	}
+
+	block_t *b = static_cast<block_t *>(::operator new(blocksz));
+	b->owner = slab;
+	b->sizeclass = cls;
+	return b + 1;
+}
+
+void TaskSlab::Free(void *ptr)
+{
+	block_t *b = static_cast<block_t *>(ptr) - 1;
+
+	if (b->sizeclass == NumClasses || !b->owner)
+	{
+		::operator delete(b);
+		return;
+	}
+
+	if (b->owner != currentSlab)
+	{
+		b->owner->PushRemote(b);
+		return;
+	}
+
+	freelist_t &fl = b->owner->local[b->sizeclass];
+	if (fl.count >= MaxCached)
+	{
+		::operator delete(b);
+		return;
+	}
+
+	b->next = fl.head;
+	fl.head = b;
+	fl.count++;
+}
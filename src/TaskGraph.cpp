@@ -0,0 +1,231 @@
+// Copyright (c) 2014-2020, Justin Crawford <Justin@stacksmash.net>
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "TaskGraph.h"
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+
+static const TaskGraph::node_t npos = static_cast<TaskGraph::node_t>(-1);
+
+TaskGraph::TaskGraph(ThreadHandler &pool) : pool(pool), pending(0), elapsed(0)
+{
+}
+
+void TaskGraph::Precede(node_t before, node_t after)
+{
+	if (before >= this->nodes.size() || after >= this->nodes.size())
+		throw std::out_of_range("TaskGraph::Precede: no such node");
+
+	this->nodes[before].successors.push_back(after);
+	this->nodes[after].predecessors++;
+}
+
+std::vector<TaskGraph::node_t> TaskGraph::TopologicalOrder() const
+{
+	std::vector<size_t> waiting(this->nodes.size());
+	std::vector<node_t> order;
+	order.reserve(this->nodes.size());
+
+	for (node_t n = 0; n < this->nodes.size(); ++n)
+	{
+		waiting[n] = this->nodes[n].predecessors;
+		if (!waiting[n])
+			order.push_back(n);
+	}
+
+	// order doubles as the queue of nodes whose predecessors are all placed
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		for (node_t s : this->nodes[order[i]].successors)
+		{
+			if (!--waiting[s])
+				order.push_back(s);
+		}
+	}
+
+	if (order.size() != this->nodes.size())
+		throw std::logic_error("TaskGraph: the graph has a cycle");
+
+	return order;
+}
+
+void TaskGraph::Execute(node_t n)
+{
+	while (n != npos)
+	{
+		graphnode_t &node = this->nodes[n];
+		auto begin = std::chrono::steady_clock::now();
+		bool failed = this->skipped[n].load(std::memory_order_acquire);
+
+		node.timing.start = begin - this->started;
+		node.timing.thread = ThreadHandler::GetThreadID();
+		node.timing.ran = !failed;
+
+		if (!failed)
+		{
+			try
+			{
+				node.func();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lk(this->errorLock);
+				if (!this->error)
+					this->error = std::current_exception();
+				failed = true;
+			}
+			node.timing.duration = std::chrono::steady_clock::now() - begin;
+		}
+
+		// Queue whatever we were the last predecessor of, but keep one to
+		// run here next, it saves a trip through the queue and its input
+		// is still in our cache. A failure skips everything downstream.
+		node_t next = npos;
+		for (node_t s : node.successors)
+		{
+			if (failed)
+				this->skipped[s].store(true, std::memory_order_relaxed);
+
+			if (this->waiting[s].fetch_sub(1, std::memory_order_acq_rel) != 1)
+				continue;
+
+			if (next == npos)
+				next = s;
+			else
+				this->pool.Enqueue([this, s]() { this->Execute(s); });
+		}
+
+		this->pending.fetch_sub(1, std::memory_order_release);
+		n = next;
+	}
+}
+
+void TaskGraph::Run()
+{
+	std::vector<node_t> order = this->TopologicalOrder();
+	size_t count = this->nodes.size();
+
+	this->waiting.reset(new std::atomic<size_t>[count]);
+	this->skipped.reset(new std::atomic<bool>[count]);
+	for (node_t n = 0; n < count; ++n)
+	{
+		this->waiting[n] = this->nodes[n].predecessors;
+		this->skipped[n] = false;
+		this->nodes[n].timing = nodetiming_t{ std::chrono::nanoseconds(0), std::chrono::nanoseconds(0), -1, false };
+	}
+
+	this->error = nullptr;
+	this->pending = count;
+	this->started = std::chrono::steady_clock::now();
+
+	// The topological order starts with every node that has no predecessors
+	for (node_t n : order)
+	{
+		if (this->nodes[n].predecessors)
+			break;
+		this->pool.Enqueue([this, n]() { this->Execute(n); });
+	}
+
+	while (this->pending.load(std::memory_order_acquire))
+	{
+		if (!this->pool.TryRunJob())
+			std::this_thread::yield();
+	}
+
+	this->elapsed = std::chrono::steady_clock::now() - this->started;
+
+	if (this->error)
+		std::rethrow_exception(this->error);
+}
+
+std::chrono::nanoseconds TaskGraph::CriticalPath(std::vector<node_t> *path) const
+{
+	if (path)
+		path->clear();
+	if (this->nodes.empty())
+		return std::chrono::nanoseconds(0);
+
+	// Longest time to reach the start of each node, and where it came from
+	std::vector<std::chrono::nanoseconds> reach(this->nodes.size(), std::chrono::nanoseconds(0));
+	std::vector<node_t> from(this->nodes.size(), npos);
+	node_t last = npos;
+	std::chrono::nanoseconds longest(-1);
+
+	for (node_t n : this->TopologicalOrder())
+	{
+		std::chrono::nanoseconds finish = reach[n] + this->nodes[n].timing.duration;
+		for (node_t s : this->nodes[n].successors)
+		{
+			if (from[s] == npos || finish > reach[s])
+			{
+				reach[s] = finish;
+				from[s] = n;
+			}
+		}
+
+		if (finish > longest)
+		{
+			longest = finish;
+			last = n;
+		}
+	}
+
+	if (path)
+	{
+		for (node_t n = last; n != npos; n = from[n])
+			path->push_back(n);
+		std::reverse(path->begin(), path->end());
+	}
+
+	return longest;
+}
+
+std::string TaskGraph::Report() const
+{
+	std::vector<node_t> path;
+	std::chrono::nanoseconds critical = this->CriticalPath(&path);
+	std::vector<bool> onPath(this->nodes.size(), false);
+	for (node_t n : path)
+		onPath[n] = true;
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%zu jobs took %.3f ms, critical path %.3f ms (* below)\n", this->nodes.size(),
+		std::chrono::duration<double, std::milli>(this->elapsed).count(), std::chrono::duration<double, std::milli>(critical).count());
+	std::string report = buf;
+
+	for (node_t n = 0; n < this->nodes.size(); ++n)
+	{
+		const nodetiming_t &t = this->nodes[n].timing;
+		if (t.ran)
+			snprintf(buf, sizeof(buf), "%c %-32s start %10.3f ms  took %10.3f ms  thread %d\n", onPath[n] ? '*' : ' ',
+				this->nodes[n].name.c_str(), std::chrono::duration<double, std::milli>(t.start).count(),
+				std::chrono::duration<double, std::milli>(t.duration).count(), t.thread);
+		else
+			snprintf(buf, sizeof(buf), "  %-32s skipped\n", this->nodes[n].name.c_str());
+		report += buf;
+	}
+
+	return report;
+}
@@ -23,6 +23,28 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "ThreadEngine.h"
+#include "nlohmann/json.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+# include <sched.h>
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+# include <ctime>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define cpu_relax() _mm_pause()
+#else
+# define cpu_relax() std::this_thread::yield()
+#endif
 
 #ifndef NDEBUG
 # include <cstdio>
@@ -37,15 +59,151 @@
 #ifndef _WIN32
 thread_local functions_t threadQueue;
 thread_local int threadid;
+thread_local WorkerThread *currentWorker;
 #else
 __declspec(thread) functions_t* threadQueue;
 __declspec(thread) int threadid;
+__declspec(thread) WorkerThread *currentWorker;
 #endif
 
-// A mutex to avoid a race condition when checking the queue.
-std::mutex queueLock;
+// How often the pool monitor looks at the queues to resize the pool.
+static const std::chrono::milliseconds monitorInterval(20);
 
-ThreadHandler::ThreadHandler() : totalConcurrentThreads(0)
+// How many times an idle worker looks for work before it parks. Jobs often
+// arrive in bursts and catching one while spinning saves the two context
+// switches of parking and being woken.
+static const unsigned int spinCount = 64;
+
+// Work out how many CPUs we're actually allowed to use. In a container the
+// host core count is meaningless, the scheduler affinity mask and the
+// cgroup CPU quota are what limit us.
+static unsigned int AvailableCPUs()
+{
+	unsigned int cpus = std::thread::hardware_concurrency();
+
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		cpus = cpus ? std::min<unsigned int>(cpus, CPU_COUNT(&set)) : CPU_COUNT(&set);
+
+	long quota = -1, period = 0;
+	// cgroup v2 has "<quota> <period>" or "max <period>" in cpu.max
+	if (FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r"))
+	{
+		char buf[32] = { 0 };
+		if (fscanf(f, "%31s %ld", buf, &period) == 2 && strcmp(buf, "max") != 0)
+			quota = atol(buf);
+		fclose(f);
+	}
+	else if (FILE *f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))
+	{
+		// cgroup v1 splits them into two files, -1 means unlimited
+		if (fscanf(f, "%ld", &quota) != 1)
+			quota = -1;
+		fclose(f);
+
+		if (FILE *p = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))
+		{
+			if (fscanf(p, "%ld", &period) != 1)
+				period = 0;
+			fclose(p);
+		}
+	}
+
+	if (quota > 0 && period > 0)
+	{
+		unsigned int limit = static_cast<unsigned int>(std::ceil(static_cast<double>(quota) / period));
+		dbgprintf("CPU quota limits us to %u CPUs\n", limit);
+		cpus = cpus ? std::min(cpus, limit) : limit;
+	}
+#endif
+
+	return cpus;
+}
+
+#ifdef __linux__
+// Read a sysfs CPU or node list such as "0-3,8-11"
+static std::vector<int> ReadIDList(const char *path)
+{
+	std::vector<int> ids;
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return ids;
+
+	int first, last;
+	while (fscanf(f, "%d", &first) == 1)
+	{
+		last = first;
+		int c = fgetc(f);
+		if (c == '-')
+		{
+			if (fscanf(f, "%d", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+
+		for (int i = first; i <= last; ++i)
+			ids.push_back(i);
+
+		if (c != ',')
+			break;
+	}
+
+	fclose(f);
+	return ids;
+}
+#endif
+
+// Find the CPUs we may use on each NUMA node. We read sysfs rather than
+// use libnuma so there's no extra dependency, nodes without any CPUs we're
+// allowed on (memory only nodes, or outside our affinity mask) are skipped.
+static std::vector<std::vector<int>> NodeTopology()
+{
+	std::vector<std::vector<int>> nodes;
+
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return nodes;
+
+	for (int n : ReadIDList("/sys/devices/system/node/online"))
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+
+		std::vector<int> cpus;
+		for (int c : ReadIDList(path))
+		{
+			if (c < CPU_SETSIZE && CPU_ISSET(c, &set))
+				cpus.push_back(c);
+		}
+
+		if (!cpus.empty())
+			nodes.push_back(std::move(cpus));
+	}
+
+	// Kernel without NUMA support, everything we can use is one node.
+	if (nodes.empty())
+	{
+		std::vector<int> cpus;
+		for (int c = 0; c < CPU_SETSIZE; ++c)
+		{
+			if (CPU_ISSET(c, &set))
+				cpus.push_back(c);
+		}
+		nodes.push_back(std::move(cpus));
+	}
+#endif
+
+	return nodes;
+}
+
+ThreadHandler::ThreadHandler() : nextWorker(0), queuedJobs(0), deadlineCount(0), activeThreads(0), idleThreads(0), blockedThreads(0),
+monitorQuitting(false), totalConcurrentThreads(0), schedMode(TS_GLOBALQUEUE), affinity(TA_NONE), minThreads(0), maxThreads(0),
+idleTimeout(30000), targetLatency(10), queueCapacity(65536), pendingLimit(65536), queuePolicy(QP_BLOCK),
+starvationLimit(100), deadlineSlack(2)
 {
 	// NOTE: Windows thread_local stuff is not complete currently, we must work around
 	// this with pointers. This will initialize a queue for the main thread.
@@ -64,15 +222,16 @@ ThreadHandler::~ThreadHandler()
 #endif
 }
 
-void ThreadHandler::Initialize()
+void ThreadHandler::Initialize(threadsched_t mode)
 {
 	dbgprintf("Thread engine initializing\n");
-	this->funcs = functions_t();
-	this->totalConcurrentThreads = std::thread::hardware_concurrency();
-
-	// We require at least 1 thread, if somehow C++ fails to epic porportions
-	// we won't fail to run the game.
-	unsigned int spawnthrds = 1;
+	for (int i = 0; i < TP_MAX; ++i)
+	{
+		this->funcs[i].Reset(this->queueCapacity);
+		this->counters[i].lastServed = Now();
+	}
+	this->schedMode = mode;
+	this->totalConcurrentThreads = AvailableCPUs();
 
 	// Some older single-core CPUs will have trouble running the game
 	// and rather than just crashing for the user or telling them
@@ -81,36 +240,194 @@ void ThreadHandler::Initialize()
 	if (this->totalConcurrentThreads <= 1)
 	{
 		dbgprintf("Seems this CPU is a bit slow, only spawning 2 threads!\n");
-		spawnthrds = this->totalConcurrentThreads = 2;
-	}
-	else // Otherwise just multiply the threads by 2, I suspect many will idle so this is fine.
-	{
-		spawnthrds = this->totalConcurrentThreads * 2;
+		this->totalConcurrentThreads = 2;
 	}
 
-	dbgprintf("Total supported threads: %d\n", this->totalConcurrentThreads);
+	// Start with a thread per CPU and let the monitor grow us up to twice
+	// that when jobs start waiting or workers block on I/O.
+	if (!this->minThreads)
+		this->minThreads = this->totalConcurrentThreads;
+	if (!this->maxThreads)
+		this->maxThreads = this->totalConcurrentThreads * 2;
+	this->maxThreads = std::max(this->maxThreads, this->minThreads);
+
+	dbgprintf("Total supported threads: %d (pool size %u to %u)\n", this->totalConcurrentThreads, this->minThreads, this->maxThreads);
 
 	// The main thread spawned by the kernel to start
 	// our process is always thread 0.
 	threadid = 0;
 
-	// Spawn the threads needed.
-	for (unsigned i = 0; i < spawnthrds; ++i)
-		new WorkerThread(i+1, this);
+	// Split the pool into a sub-pool per NUMA node when pinning, unpinned
+	// workers can run anywhere so they all share one.
+	if (this->affinity != TA_NONE)
+		this->nodeCPUs = NodeTopology();
+	if (this->nodeCPUs.empty() || this->affinity == TA_NONE)
+		this->nodeCPUs.assign(1, std::vector<int>());
+
+	size_t nnodes = this->nodeCPUs.size();
+	this->nodeFuncs.clear();
+	if (nnodes > 1)
+	{
+		for (size_t i = 0; i < nnodes; ++i)
+			this->nodeFuncs.push_back(std::make_unique<jobqueue_t>(this->queueCapacity));
+	}
+
+	dbgprintf("Workers are split over %zu NUMA node(s)\n", nnodes);
+
+	// Create every worker slot we could ever need up front so the thread
+	// list never changes while the workers walk it looking for victims.
+	for (unsigned i = 0; i < this->maxThreads; ++i)
+	{
+		WorkerThread *t = new WorkerThread(i+1, this);
+		const std::vector<int> &cpus = this->nodeCPUs[i % nnodes];
+		t->node = i % nnodes;
+		t->cpu = cpus.empty() ? -1 : cpus[(i / nnodes) % cpus.size()];
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(this->poolLock);
+		while (this->activeThreads < this->minThreads)
+			this->Threads[this->activeThreads++]->Start();
+	}
+
+	this->monitorQuitting = false;
+	this->monitor = std::thread(&ThreadHandler::Monitor, this);
+
+	dbgprintf("Spawned %u threads\n", this->activeThreads.load());
+}
+
+void ThreadHandler::Monitor()
+{
+	std::vector<uint64_t> lastRun(this->Threads.size(), 0);
+	auto nextTick = std::chrono::steady_clock::now() + monitorInterval;
+	unsigned int lastBlocked = 0;
+
+	std::unique_lock<std::mutex> lk(this->poolLock);
+	while (!this->monitorQuitting)
+	{
+		auto wake = nextTick;
+		if (!this->timedJobs.empty())
+			wake = std::min(wake, this->timedJobs.front().when);
+
+		this->monitorCV.wait_until(lk, wake);
+		if (this->monitorQuitting)
+			break;
+
+		// Hand out the timed jobs which are due, Enqueue() can end up running
+		// jobs itself when the queues are full so don't hold the lock.
+		auto now = std::chrono::steady_clock::now();
+		if (!this->timedJobs.empty() && this->timedJobs.front().when <= now)
+		{
+			std::vector<timedjob_t> due;
+			while (!this->timedJobs.empty() && this->timedJobs.front().when <= now)
+			{
+				std::pop_heap(this->timedJobs.begin(), this->timedJobs.end(), [](const timedjob_t &a, const timedjob_t &b) { return a.when > b.when; });
+				due.push_back(std::move(this->timedJobs.back()));
+				this->timedJobs.pop_back();
+			}
+
+			lk.unlock();
+			for (auto &j : due)
+				this->Enqueue(std::move(j.func), j.priority);
+			lk.lock();
+
+			if (this->monitorQuitting)
+				break;
+		}
+
+		// Resize once per interval, or straight away when a worker blocks.
+		unsigned int blocked = this->blockedThreads;
+		bool blocking = blocked > lastBlocked;
+		lastBlocked = blocked;
+		if (now < nextTick && !blocking)
+			continue;
+		nextTick = now + monitorInterval;
+
+		// How many jobs got done since we last looked
+		uint64_t completed = 0;
+		for (size_t i = 0; i < this->Threads.size(); ++i)
+		{
+			uint64_t run = this->Threads[i]->jobsRun.load(std::memory_order_relaxed);
+			completed += run - lastRun[i];
+			lastRun[i] = run;
+		}
+
+		unsigned int active = this->activeThreads;
+		if (active >= this->maxThreads || this->idleThreads.load() > 0)
+			continue;
+
+		size_t pending = this->PendingJobs();
+		if (!pending)
+			continue;
+
+		// Little's law: the jobs waiting now will take pending / throughput
+		// to clear at the current rate. Nothing completing at all means every
+		// worker is stuck in a long job.
+		bool slow = !completed || std::chrono::duration<double>(monitorInterval) * (static_cast<double>(pending) / completed) > this->targetLatency;
+		// Workers blocked in I/O aren't using their CPU, replace them.
+		bool starved = active - std::min(active, this->blockedThreads.load()) < this->totalConcurrentThreads;
+
+		if (slow || starved)
+		{
+			dbgprintf("Growing thread pool to %u threads (%zu jobs pending)\n", active + 1, pending);
+			this->Threads[this->activeThreads++]->Start();
+		}
+	}
+}
+
+void ThreadHandler::BeginBlocking()
+{
+	this->blockedThreads++;
+	// Let the monitor know straight away rather than at its next tick.
+	this->monitorCV.notify_one();
+}
 
-	dbgprintf("Spawned %zu threads\n", this->Threads.size());
+void ThreadHandler::EndBlocking()
+{
+	this->blockedThreads--;
 }
 
 void ThreadHandler::Shutdown()
 {
 	dbgprintf("Thread engine shutting down...\n");
+	// Stop resizing the pool before we take it apart.
+	{
+		std::lock_guard<std::mutex> lk(this->poolLock);
+		this->monitorQuitting = true;
+	}
+	this->monitorCV.notify_all();
+	if (this->monitor.joinable())
+		this->monitor.join();
+
 	// Wake all threads, make this->funcs read only, finish work, shutdown threads
 	this->JoinThreads();
+	this->idleStack.clear();
+	if (!this->timedJobs.empty())
+		dbgprintf("%zu timed jobs were never due and will not be processed.\n", this->timedJobs.size());
+	this->timedJobs.clear();
 	// We avoid a race condition because all threads have been joined at this point.
-	dbgprintf("%lu jobs left and will not be processed.\n", this->funcs.size());
+	dbgprintf("%zu jobs left and will not be processed.\n", this->PendingJobs());
+
+	while (!this->Threads.empty())
+		delete this->Threads.back();
+	this->activeThreads = 0;
+}
+
+size_t ThreadHandler::PendingJobs()
+{
+	size_t pending = this->deadlineCount;
+	for (const auto &q : this->funcs)
+		pending += q.size();
+	for (const auto &q : this->nodeFuncs)
+		pending += q->size();
+
+	for (const auto &t : this->Threads)
+	{
+		std::lock_guard<std::mutex> lk(t->jobLock);
+		pending += t->jobs.size();
+	}
 
-	for (auto it = this->Threads.begin(), it_end = this->Threads.end(); it != it_end;)
-		delete *(it++);
+	return pending;
 }
 
 void ThreadHandler::JoinThreads()
@@ -118,59 +435,564 @@ void ThreadHandler::JoinThreads()
 	for (const auto &t : this->Threads)
 		t->quitting = true;
 
-	this->WakeThreads();
+	this->WakeAllThreads();
 
 	for (const auto &t : this->Threads)
 		t->Join();
 }
 
-void ThreadHandler::WakeThreads()
+void ThreadHandler::ParkWorker(WorkerThread *t)
 {
-	for (const auto &t : this->Threads)
+	std::lock_guard<std::mutex> lk(this->idleLock);
+	this->idleStack.push_back(t);
+}
+
+bool ThreadHandler::UnparkWorker(WorkerThread *t)
+{
+	std::lock_guard<std::mutex> lk(this->idleLock);
+	auto it = std::find(this->idleStack.begin(), this->idleStack.end(), t);
+	if (it == this->idleStack.end())
+		return false;
+
+	this->idleStack.erase(it);
+	return true;
+}
+
+void ThreadHandler::WakeThreads(size_t count, int node)
+{
+	// Cheap check first, most submissions happen while everyone is busy. This
+	// is a read-modify-write so it pairs with the increment in Sleep(), either
+	// we see the sleeper or it sees our jobs.
+	if (!count || !this->idleThreads.fetch_add(0, std::memory_order_acq_rel))
+		return;
+
+	WorkerThread *wake[16];
+	while (count)
+	{
+		size_t n = 0;
+		{
+			std::lock_guard<std::mutex> lk(this->idleLock);
+			while (n < count && n < 16 && !this->idleStack.empty())
+			{
+				// Prefer the most recently parked worker on the jobs' node
+				auto it = this->idleStack.end() - 1;
+				if (node >= 0)
+				{
+					auto match = std::find_if(this->idleStack.rbegin(), this->idleStack.rend(), [node](WorkerThread *t) { return t->node == static_cast<unsigned int>(node); });
+					if (match != this->idleStack.rend())
+						it = std::prev(match.base());
+				}
+
+				wake[n] = *it;
+				this->idleStack.erase(it);
+				// Set the token while we hold the lock, a worker that times out
+				// and finds itself gone from the stack relies on it being set.
+				wake[n++]->wakeToken.store(1, std::memory_order_release);
+			}
+		}
+
+		if (!n)
+			break;
+
+		for (size_t i = 0; i < n; ++i)
+			wake[i]->Wake();
+		count -= n;
+	}
+}
+
+void ThreadHandler::WakeAllThreads()
+{
+	std::vector<WorkerThread*> wake;
+	{
+		std::lock_guard<std::mutex> lk(this->idleLock);
+		wake.swap(this->idleStack);
+		for (const auto &t : wake)
+			t->wakeToken.store(1, std::memory_order_release);
+	}
+
+	for (const auto &t : wake)
 		t->Wake();
 }
 
-bool ThreadHandler::Submit(bool noStall)
+WorkerThread *ThreadHandler::PickWorker(int node, size_t nthreads)
+{
+	if (node < 0)
+		return this->Threads[this->nextWorker.fetch_add(1, std::memory_order_relaxed) % nthreads];
+
+	// Workers on node are every nnodes'th slot starting at node
+	size_t nnodes = this->nodeCPUs.size();
+	size_t onNode = nthreads > static_cast<size_t>(node) ? (nthreads - node + nnodes - 1) / nnodes : 0;
+	if (!onNode)
+		return nullptr;
+
+	return this->Threads[node + (this->nextWorker.fetch_add(1, std::memory_order_relaxed) % onNode) * nnodes];
+}
+
+bool ThreadHandler::PopShared(unsigned int node, bool remote, function_t &func)
 {
-	// Acquire a lock. if noStall, return -1 so the function can continue, otherwise wait until the lock is acquired
-	if (noStall)
+	if (!remote)
 	{
-		if (!queueLock.try_lock())
-			return false;
+		if (!this->nodeFuncs.empty() && this->nodeFuncs[node]->Pop(func))
+			return true;
+		return this->funcs[TP_NORMAL].Pop(func);
 	}
-	else
-		queueLock.lock();
 
+	for (size_t i = 1; i < this->nodeFuncs.size(); ++i)
+	{
+		if (this->nodeFuncs[(node + i) % this->nodeFuncs.size()]->Pop(func))
+			return true;
+	}
+
+	return false;
+}
+
+bool ThreadHandler::Submit(bool noStall, taskpriority_t priority, int node)
+{
 #ifndef _WIN32
-	// Submit the functions pending
-	while (!threadQueue.empty())
+	functions_t &pending = threadQueue;
+#else
+	functions_t &pending = *threadQueue;
+#endif
+
+	return this->SubmitBatch(pending, priority, node, noStall ? QP_FAIL : this->queuePolicy);
+}
+
+bool ThreadHandler::SubmitBatch(functions_t &pending, taskpriority_t priority, int node)
+{
+	return this->SubmitBatch(pending, priority, node, this->queuePolicy);
+}
+
+size_t ThreadHandler::Reserve(size_t count)
+{
+	if (!this->pendingLimit)
+	{
+		this->queuedJobs.fetch_add(count, std::memory_order_relaxed);
+		return count;
+	}
+
+	size_t queued = this->queuedJobs.load(std::memory_order_relaxed), n;
+	do
+	{
+		n = std::min(count, queued < this->pendingLimit ? this->pendingLimit - queued : 0);
+		if (!n)
+			return 0;
+	} while (!this->queuedJobs.compare_exchange_weak(queued, queued + n, std::memory_order_relaxed));
+
+	return n;
+}
+
+bool ThreadHandler::SubmitBatch(functions_t &pending, taskpriority_t priority, int node, queuepolicy_t policy)
+{
+	// Node hints only apply to normal jobs and only when we have nodes.
+	if (priority != TP_NORMAL || node >= static_cast<int>(this->nodeFuncs.size()))
+		node = -1;
+
+	schedcounters_t &c = this->counters[priority];
+	while (!pending.empty())
 	{
-		// Remove function from thread local stack
-		function_t func = threadQueue.front();
-		threadQueue.pop();
+		// Publish as much of the batch as there is room for in one go.
+		if (size_t n = this->Reserve(pending.size()))
+		{
+			c.queued.fetch_add(n, std::memory_order_relaxed);
+			this->Publish(pending, n, priority, node, policy != QP_BLOCK);
+			continue;
+		}
 
-		// Move to global stack so threads can pick what is needed
-		this->funcs.push(func);
+		// Too many jobs waiting already, push back on the caller.
+		switch (policy)
+		{
+			case QP_FAIL:
+				c.rejected.fetch_add(pending.size(), std::memory_order_relaxed);
+				return false;
+			case QP_INLINE:
+			{
+				function_t func = std::move(pending.front());
+				pending.pop_front();
+				func();
+				c.inlined.fetch_add(1, std::memory_order_relaxed);
+				break;
+			}
+			default:
+				if (!this->TryRunJob())
+					std::this_thread::yield();
+		}
 	}
-#else
-	// Submit the functions pending
-	while (!threadQueue->empty())
+
+	return true;
+}
+
+void ThreadHandler::Publish(functions_t &pending, size_t count, taskpriority_t priority, int node, bool noStall)
+{
+	// The workers we can give the batch to, every stride'th from first.
+	size_t nthreads = this->activeThreads;
+	size_t stride = node < 0 ? 1 : this->nodeCPUs.size(), first = node < 0 ? 0 : node;
+	size_t targets = nthreads > first ? (nthreads - first + stride - 1) / stride : 0;
+
+	if (this->schedMode == TS_WORKSTEALING && priority == TP_NORMAL && targets)
 	{
-		// Remove function from thread local stack
-		function_t func = threadQueue->front();
-		threadQueue->pop();
+		// Spread the batch over the running workers' deques in contiguous
+		// chunks, each chunk costs a single lock on the receiving worker.
+		// We start at a different worker each time so small batches don't
+		// all land on the first deque.
+		size_t chunk = (count + targets - 1) / targets;
+		unsigned int start = this->nextWorker.fetch_add(1, std::memory_order_relaxed);
+
+		for (size_t i = 0, left = count; left; ++i)
+		{
+			// With noStall we skip past workers whose deque is busy on the
+			// first pass, after that we wait for whichever is next.
+			WorkerThread *t = this->Threads[first + ((start + i) % targets) * stride];
+			size_t n = std::min(chunk, left);
+			if (t->PushJobs(pending, n, noStall && i < targets))
+				left -= n;
+		}
 
-		// Move to global stack so threads can pick what is needed
-		this->funcs.push(func);
+		this->WakeThreads(count, node);
+		return;
+	}
+
+	jobqueue_t &queue = node < 0 ? this->funcs[priority] : *this->nodeFuncs[node];
+
+	// Move the functions pending to the global queue so threads can pick
+	// what is needed. Each call claims as many free slots as it can in one
+	// go so a batch costs one atomic operation rather than one per job.
+	for (size_t left = count; left;)
+	{
+		if (size_t n = queue.PushBatch(pending, left))
+		{
+			left -= n;
+			continue;
+		}
+
+		// The ring itself is full, only possible when it is smaller than
+		// pendingLimit. The jobs are already admitted so help drain it.
+		if (!this->TryRunJob())
+			std::this_thread::yield();
+	}
+
+	// Notify the threads that there is work, one for each job
+	this->WakeThreads(count, node);
+}
+
+void ThreadHandler::Enqueue(function_t &&func, taskpriority_t priority, int node)
+{
+	if (!func.queued)
+		func.queued = Now();
+	this->counters[priority].queued.fetch_add(1, std::memory_order_relaxed);
+	// Always admitted, see pendingLimit.
+	this->queuedJobs.fetch_add(1, std::memory_order_relaxed);
+
+	if (priority != TP_NORMAL || node >= static_cast<int>(this->nodeFuncs.size()))
+		node = -1;
+
+	size_t nthreads = this->activeThreads;
+	WorkerThread *t = nullptr;
+	if (this->schedMode == TS_WORKSTEALING && priority == TP_NORMAL && nthreads)
+	{
+		// A worker keeps the jobs it enqueues, they most likely touch the
+		// data it was just working on. Anyone else hands them out in turn.
+		t = currentWorker;
+		if (!t || t->thr != this || (node >= 0 && t->node != static_cast<unsigned int>(node)))
+			t = this->PickWorker(node, nthreads);
+	}
+
+	if (t)
+	{
+		std::lock_guard<std::mutex> lk(t->jobLock);
+		t->jobs.push_back(std::move(func));
+	}
+	else
+	{
+		// Make room ourselves if the queue is full, waiting for the workers
+		// would deadlock if we are the only one of them left.
+		jobqueue_t &queue = node < 0 ? this->funcs[priority] : *this->nodeFuncs[node];
+		while (!queue.Push(std::move(func)))
+		{
+			if (!this->TryRunJob())
+				std::this_thread::yield();
+		}
 	}
-#endif
 
-	// release our lock
-	queueLock.unlock();
+	this->WakeThreads(1, node);
+}
+
+void ThreadHandler::Enqueue(function_t &&func, std::chrono::steady_clock::time_point deadline, taskpriority_t priority)
+{
+	if (!func.queued)
+		func.queued = Now();
+	this->counters[priority].queued.fetch_add(1, std::memory_order_relaxed);
+	this->queuedJobs.fetch_add(1, std::memory_order_relaxed);
 
-	// Notify the threads that there is work
-	this->WakeThreads();
+	{
+		std::lock_guard<std::mutex> lk(this->deadlineLock);
+		std::vector<deadlinejob_t> &heap = this->deadlines[priority];
+		heap.push_back(deadlinejob_t{ deadline, std::move(func) });
+		std::push_heap(heap.begin(), heap.end(), [](const deadlinejob_t &a, const deadlinejob_t &b) { return a.deadline > b.deadline; });
+		this->deadlineCount++;
+	}
 
+	this->WakeThreads(1);
+}
+
+void ThreadHandler::EnqueueAfter(function_t &&func, std::chrono::steady_clock::duration delay, taskpriority_t priority)
+{
+	auto when = std::chrono::steady_clock::now() + delay;
+	// Count the wait from when the job is due, not from now.
+	func.queued = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+
+	bool earliest;
+	{
+		std::lock_guard<std::mutex> lk(this->poolLock);
+		earliest = this->timedJobs.empty() || when < this->timedJobs.front().when;
+		this->timedJobs.push_back(timedjob_t{ when, priority, std::move(func) });
+		std::push_heap(this->timedJobs.begin(), this->timedJobs.end(), [](const timedjob_t &a, const timedjob_t &b) { return a.when > b.when; });
+	}
+
+	// The monitor only needs to know if it has to wake up sooner.
+	if (earliest)
+		this->monitorCV.notify_one();
+}
+
+bool ThreadHandler::PopDeadline(function_t &func, int &priority, std::chrono::steady_clock::time_point before)
+{
+	std::lock_guard<std::mutex> lk(this->deadlineLock);
+
+	int first = priority < 0 ? 0 : priority, last = priority < 0 ? TP_MAX - 1 : priority;
+	int best = -1;
+	for (int i = first; i <= last; ++i)
+	{
+		const std::vector<deadlinejob_t> &heap = this->deadlines[i];
+		if (!heap.empty() && heap.front().deadline <= before && (best < 0 || heap.front().deadline < this->deadlines[best].front().deadline))
+			best = i;
+	}
+
+	if (best < 0)
+		return false;
+
+	std::vector<deadlinejob_t> &heap = this->deadlines[best];
+	std::pop_heap(heap.begin(), heap.end(), [](const deadlinejob_t &a, const deadlinejob_t &b) { return a.deadline > b.deadline; });
+
+	if (heap.back().deadline < std::chrono::steady_clock::now())
+		this->counters[best].deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+
+	func = std::move(heap.back().func);
+	heap.pop_back();
+	this->deadlineCount--;
+	priority = best;
+	return true;
+}
+
+bool ThreadHandler::PopClass(WorkerThread *self, int priority, function_t &func)
+{
+	if (this->deadlineCount && this->PopDeadline(func, priority, std::chrono::steady_clock::time_point::max()))
+		return true;
+
+	if (priority != TP_NORMAL)
+		return this->funcs[priority].Pop(func);
+
+	if (this->schedMode == TS_WORKSTEALING)
+	{
+		if (self)
+			return self->FindJob(func);
+
+		// Not one of our workers, act like a thief on every deque.
+		for (const auto &t : this->Threads)
+		{
+			if (t->StealJob(func))
+				return true;
+		}
+	}
+
+	unsigned int node = self ? self->node : 0;
+	return this->PopShared(node, false, func) || this->PopShared(node, true, func);
+}
+
+bool ThreadHandler::NextJob(WorkerThread *self, function_t &func)
+{
+	auto now = std::chrono::steady_clock::now();
+	int64_t nowns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+	int priority = -1;
+
+	// Anything about to miss its deadline goes first, whatever its class.
+	if (!this->deadlineCount || !this->PopDeadline(func, priority, now + this->deadlineSlack))
+	{
+		priority = -1;
+
+		// Give the lowest class which has been starved too long the first go.
+		int order[TP_MAX] = { TP_REALTIME, TP_NORMAL, TP_BACKGROUND };
+		int64_t limit = std::chrono::duration_cast<std::chrono::nanoseconds>(this->starvationLimit).count();
+		for (int i = TP_MAX - 1; i > 0; --i)
+		{
+			if (nowns - this->counters[i].lastServed.load(std::memory_order_relaxed) > limit)
+			{
+				std::rotate(order, order + i, order + i + 1);
+				break;
+			}
+		}
+
+		for (int i = 0; i < TP_MAX && priority < 0; ++i)
+		{
+			if (this->PopClass(self, order[i], func))
+				priority = order[i];
+			else
+				this->counters[order[i]].lastServed.store(nowns, std::memory_order_relaxed);
+		}
+
+		if (priority < 0)
+			return false;
+	}
+
+	this->queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+
+	schedcounters_t &c = this->counters[priority];
+	c.run.fetch_add(1, std::memory_order_relaxed);
+	c.lastServed.store(nowns, std::memory_order_relaxed);
+
+	if (func.queued)
+	{
+		uint64_t wait = static_cast<uint64_t>(nowns) > func.queued ? nowns - func.queued : 0;
+		c.waitTotal.fetch_add(wait, std::memory_order_relaxed);
+		uint64_t max = c.waitMax.load(std::memory_order_relaxed);
+		while (wait > max && !c.waitMax.compare_exchange_weak(max, wait, std::memory_order_relaxed))
+			;
+
+		if (self)
+			self->RecordWait(wait);
+	}
+
+	return true;
+}
+
+std::vector<workerstats_t> ThreadHandler::Telemetry()
+{
+	std::vector<workerstats_t> workers;
+	workers.reserve(this->Threads.size());
+
+	unsigned int active = this->activeThreads;
+	for (const auto &t : this->Threads)
+	{
+		workerstats_t w;
+		w.threadID = t->threadID;
+		w.node = t->node;
+		w.running = t->index < active;
+		w.jobsRun = t->jobsRun.load(std::memory_order_relaxed);
+		w.steals = t->steals.load(std::memory_order_relaxed);
+		w.busy = std::chrono::nanoseconds(t->busyTime.load(std::memory_order_relaxed));
+		w.idle = std::chrono::nanoseconds(t->idleTime.load(std::memory_order_relaxed));
+		w.searching = std::chrono::nanoseconds(t->searchTime.load(std::memory_order_relaxed));
+		w.longestJob = std::chrono::nanoseconds(t->longestJob.load(std::memory_order_relaxed));
+		for (size_t i = 0; i < WaitHistogramBuckets; ++i)
+			w.waitHistogram[i] = t->waitHistogram[i].load(std::memory_order_relaxed);
+		workers.push_back(w);
+	}
+
+	return workers;
+}
+
+nlohmann::json ThreadHandler::TelemetryJSON()
+{
+	static const char *classNames[TP_MAX] = { "realtime", "normal", "background" };
+	nlohmann::json j;
+
+	j["threads"] = {
+		{ "active", this->activeThreads.load() },
+		{ "idle", this->idleThreads.load() },
+		{ "blocked", this->blockedThreads.load() },
+		{ "min", this->minThreads },
+		{ "max", this->maxThreads },
+	};
+	j["pending"] = this->PendingJobs();
+
+	for (int i = 0; i < TP_MAX; ++i)
+	{
+		schedstats_t s = this->Stats(static_cast<taskpriority_t>(i));
+		j["classes"][classNames[i]] = {
+			{ "depth", s.depth },
+			{ "queued", s.queued },
+			{ "run", s.run },
+			{ "wait_total_ns", s.waitTotal },
+			{ "wait_max_ns", s.waitMax },
+			{ "deadline_misses", s.deadlineMisses },
+			{ "rejected", s.rejected },
+			{ "inlined", s.inlined },
+		};
+	}
+
+	j["workers"] = nlohmann::json::array();
+	for (const workerstats_t &w : this->Telemetry())
+	{
+		// Only the buckets with something in them, the last has no bound
+		nlohmann::json histogram = nlohmann::json::array();
+		for (size_t i = 0; i < WaitHistogramBuckets; ++i)
+		{
+			if (!w.waitHistogram[i])
+				continue;
+
+			nlohmann::json bucket = { { "count", w.waitHistogram[i] } };
+			if (i + 1 < WaitHistogramBuckets)
+				bucket["under_us"] = 1ULL << i;
+			histogram.push_back(bucket);
+		}
+
+		j["workers"].push_back({
+			{ "id", w.threadID },
+			{ "node", w.node },
+			{ "running", w.running },
+			{ "jobs", w.jobsRun },
+			{ "steals", w.steals },
+			{ "busy_ns", w.busy.count() },
+			{ "idle_ns", w.idle.count() },
+			{ "searching_ns", w.searching.count() },
+			{ "longest_job_ns", w.longestJob.count() },
+			{ "wait_histogram", histogram },
+		});
+	}
+
+	return j;
+}
+
+schedstats_t ThreadHandler::Stats(taskpriority_t priority)
+{
+	schedstats_t stats;
+	const schedcounters_t &c = this->counters[priority];
+
+	stats.depth = this->funcs[priority].size();
+	if (priority == TP_NORMAL)
+	{
+		for (const auto &q : this->nodeFuncs)
+			stats.depth += q->size();
+
+		for (const auto &t : this->Threads)
+		{
+			std::lock_guard<std::mutex> lk(t->jobLock);
+			stats.depth += t->jobs.size();
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(this->deadlineLock);
+		stats.depth += this->deadlines[priority].size();
+	}
+
+	stats.queued = c.queued;
+	stats.run = c.run;
+	stats.waitTotal = c.waitTotal;
+	stats.waitMax = c.waitMax;
+	stats.deadlineMisses = c.deadlineMisses;
+	stats.rejected = c.rejected;
+	stats.inlined = c.inlined;
+	return stats;
+}
+
+bool ThreadHandler::TryRunJob()
+{
+	function_t func;
+	WorkerThread *self = currentWorker;
+
+	if (!this->NextJob(self && self->thr == this ? self : nullptr, func))
+		return false;
+
+	func();
 	return true;
 }
 
@@ -182,39 +1004,227 @@ int ThreadHandler::GetThreadID()
 /******************************************************************/
 
 
-WorkerThread::WorkerThread(int ThreadID, ThreadHandler *thr) : wakeThread(false),
-thr(thr), threadID(ThreadID), quitting(false)
+WorkerThread::WorkerThread(int ThreadID, ThreadHandler *thr) : wakeToken(0),
+thr(thr), threadID(ThreadID), node(0), cpu(-1), jobsRun(0), steals(0), busyTime(0), idleTime(0),
+searchTime(0), longestJob(0), quitting(false)
 {
-	printf("Thread ID: %i\n", ThreadID);
-	// NOTICE: We must wait for the class to initialize before we can start our thread
-	// otherwise we get uninitialized values which can cause a race condition
-	// and undefined behavior when the class
-	this->th = std::thread(&WorkerThread::Main, this);
+	dbgprintf("Thread ID: %i\n", ThreadID);
 	// Add the thread to the thread list
+	this->index = thr->Threads.size();
 	thr->Threads.push_back(this);
 }
 
 WorkerThread::~WorkerThread()
 {
 	// Remove the thread from the thread list
-	this->thr->Threads.remove(this);
+	auto it = std::find(this->thr->Threads.begin(), this->thr->Threads.end(), this);
+	if (it != this->thr->Threads.end())
+		this->thr->Threads.erase(it);
+}
+
+void WorkerThread::Start()
+{
+	// A retired worker has finished (or is about to) so this won't stall.
+	if (this->th.joinable())
+		this->th.join();
+
+	// NOTICE: We must wait for the class to initialize before we can start our thread
+	// otherwise we get uninitialized values which can cause a race condition
+	// and undefined behavior when the class
+	this->quitting = false;
+	this->th = std::thread(&WorkerThread::Main, this);
+}
+
+bool WorkerThread::Retire()
+{
+	std::lock_guard<std::mutex> lk(this->thr->poolLock);
+
+	// Only the last running worker retires so the running workers are
+	// always the start of the thread list.
+	if (this->thr->monitorQuitting || this->index + 1 != this->thr->activeThreads ||
+		this->thr->activeThreads <= this->thr->minThreads)
+		return false;
+
+	// Anything that landed on our deque goes back to our node's queue where
+	// the remaining workers will find it. If that is full we stay around.
+	{
+		jobqueue_t &queue = this->thr->nodeFuncs.empty() ? this->thr->funcs[TP_NORMAL] : *this->thr->nodeFuncs[this->node];
+		std::lock_guard<std::mutex> jlk(this->jobLock);
+		while (!this->jobs.empty() && queue.Push(std::move(this->jobs.front())))
+			this->jobs.pop_front();
+
+		if (!this->jobs.empty())
+			return false;
+	}
+
+	this->thr->activeThreads--;
+
+	dbgprintf("Thread %d retiring after being idle, %u threads left\n", this->threadID, this->thr->activeThreads.load());
+	return true;
+}
+
+bool WorkerThread::PushJobs(functions_t &q, size_t count, bool tryOnly)
+{
+	std::unique_lock<std::mutex> lk(this->jobLock, std::defer_lock);
+	if (!tryOnly)
+		lk.lock();
+	else if (!lk.try_lock())
+		return false;
+
+	for (; count && !q.empty(); --count)
+	{
+		this->jobs.push_back(std::move(q.front()));
+		q.pop_front();
+	}
+	return true;
+}
+
+bool WorkerThread::PopJob(function_t &func)
+{
+	std::lock_guard<std::mutex> lk(this->jobLock);
+	if (this->jobs.empty())
+		return false;
+
+	func = std::move(this->jobs.back());
+	this->jobs.pop_back();
+	return true;
+}
+
+bool WorkerThread::StealJob(function_t &func)
+{
+	// Don't wait on a victim that is busy with its own deque, just move on.
+	std::unique_lock<std::mutex> lk(this->jobLock, std::try_to_lock);
+	if (!lk.owns_lock() || this->jobs.empty())
+		return false;
+
+	func = std::move(this->jobs.front());
+	this->jobs.pop_front();
+	return true;
 }
 
-void WorkerThread::Sleep()
+bool WorkerThread::FindJob(function_t &func)
 {
-	std::unique_lock<std::mutex> lk(this->m);
-	this->cv.wait(lk, [this] (){return this->wakeThread; });
-	this->wakeThread = false;
+	if (this->PopJob(func))
+		return true;
+
+	// Our deque is empty, go through the other workers starting just after us
+	// so that the thieves spread out instead of all hitting the first worker.
+	// Workers on our own node go first, then the shared queues (jobs hinted
+	// at our node, jobs submitted before the workers existed and any left by
+	// retired workers), and only then do we cross to the other nodes.
+	const std::vector<WorkerThread*> &threads = this->thr->Threads;
+	size_t nthreads = threads.size();
+	int passes = this->thr->nodeCPUs.size() > 1 ? 2 : 1;
+
+	for (int remote = 0; remote < passes; ++remote)
+	{
+		for (size_t i = 1; i < nthreads; ++i)
+		{
+			WorkerThread *t = threads[(this->index + i) % nthreads];
+			if ((t->node != this->node) == static_cast<bool>(remote) && t->StealJob(func))
+			{
+				Count(this->steals);
+				return true;
+			}
+		}
+
+		if (this->thr->PopShared(this->node, remote, func))
+			return true;
+	}
+
+	return false;
+}
+
+bool WorkerThread::Sleep()
+{
+	// Put ourselves on the idle stack before the final look at the queues.
+	// A job submitted after that look will find us on the stack and wake
+	// us, one submitted before it is seen by the look.
+	this->thr->idleThreads.fetch_add(1, std::memory_order_seq_cst);
+	this->thr->ParkWorker(this);
+
+	bool woken = true;
+	if (!this->thr->PendingJobs() && !this->quitting)
+	{
+#ifdef __linux__
+		struct timespec ts;
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(this->thr->idleTimeout).count();
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+
+		// Sleep in the kernel until the token is set or we time out, the
+		// futex only blocks if the token is still 0 so a wake between the
+		// check and the syscall is never lost.
+		while (!this->wakeToken.load(std::memory_order_acquire))
+		{
+			if (syscall(SYS_futex, reinterpret_cast<uint32_t*>(&this->wakeToken), FUTEX_WAIT_PRIVATE, 0, &ts, nullptr, 0) == -1 &&
+				errno == ETIMEDOUT)
+				break;
+		}
+#else
+		std::unique_lock<std::mutex> lk(this->m);
+		this->cv.wait_for(lk, this->thr->idleTimeout, [this] (){return this->wakeToken.load() != 0; });
+#endif
+		woken = this->wakeToken.load(std::memory_order_acquire) != 0;
+	}
+
+	// If we're still on the stack nobody woke us, otherwise the waker set our
+	// token while holding the idle lock so it is visible by now.
+	if (this->thr->UnparkWorker(this))
+		woken = woken || this->wakeToken.load(std::memory_order_acquire);
+	else
+		woken = true;
+
+	this->wakeToken.store(0, std::memory_order_relaxed);
+	this->thr->idleThreads.fetch_sub(1, std::memory_order_relaxed);
+	return woken;
+}
+
+void WorkerThread::RecordWait(uint64_t ns)
+{
+	size_t bucket = std::min<size_t>(std::bit_width(ns / 1000), WaitHistogramBuckets - 1);
+	Count(this->waitHistogram[bucket]);
 }
 
 void WorkerThread::Wake()
 {
-	wakeThread = true;
-	this->cv.notify_all();
+	this->wakeToken.store(1, std::memory_order_release);
+#ifdef __linux__
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&this->wakeToken), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+	{
+		std::lock_guard<std::mutex> lk(this->m);
+	}
+	this->cv.notify_one();
+#endif
+}
+
+void WorkerThread::Pin()
+{
+#ifdef __linux__
+	if (this->thr->affinity == TA_NONE)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (this->thr->affinity == TA_CORE && this->cpu >= 0)
+		CPU_SET(this->cpu, &set);
+	else
+	{
+		for (int c : this->thr->nodeCPUs[this->node])
+			CPU_SET(c, &set);
+	}
+
+	if (CPU_COUNT(&set) && sched_setaffinity(0, sizeof(set), &set) != 0)
+		dbgprintf("Thread %d could not be pinned: %s\n", this->threadID, strerror(errno));
+#endif
 }
 
 void WorkerThread::Join()
 {
+	if (!this->th.joinable())
+		return;
+
 	dbgprintf("Thread %i joining to next thread...\n", this->threadID);
 	this->quitting = true;
 	this->th.join();
@@ -228,28 +1238,52 @@ void WorkerThread::Main()
 	threadQueue = queue;
 #endif
 	threadid = this->threadID;
+	currentWorker = this;
+	this->Pin();
+	unsigned int spins = 0;
+	// When we last finished a job or woke up, the time since is searching
+	uint64_t mark = ThreadHandler::Now();
 	while (!this->quitting)
 	{
-		// Acquire a lock on the queue and get the data
-		queueLock.lock();
-
 		// Check the funcs are in the queue and ready to be processed
-		if (!this->thr->funcs.empty())
+		function_t func;
+		if (this->thr->NextJob(this, func))
 		{
-			// Get a local copy of the function
-			function_t func = this->thr->funcs.front();
-			this->thr->funcs.pop();
-
-			// Release our lock so other threads can use it before we run our function.
-			queueLock.unlock();
+			uint64_t start = ThreadHandler::Now();
+			Count(this->searchTime, start - mark);
 
-			// Run the function (we released the lock in case the function takes a long time to run)
+			// Run the function, the queues are not locked while it runs
 			func();
+
+			mark = ThreadHandler::Now();
+			Count(this->busyTime, mark - start);
+			if (mark - start > this->longestJob.load(std::memory_order_relaxed))
+				this->longestJob.store(mark - start, std::memory_order_relaxed);
+
+			this->jobsRun.fetch_add(1, std::memory_order_relaxed);
+			spins = 0;
+		}
+		else if (spins < spinCount)
+		{
+			// Nothing yet, spin a little before we give up the CPU.
+			spins++;
+			for (unsigned int i = 0; i < spins; ++i)
+				cpu_relax();
 		}
 		else
 		{
-			queueLock.unlock();
-			this->Sleep();
+			spins = 0;
+			uint64_t start = ThreadHandler::Now();
+			Count(this->searchTime, start - mark);
+
+			bool woken = this->Sleep();
+
+			mark = ThreadHandler::Now();
+			Count(this->idleTime, mark - start);
+
+			// Idle for too long, retire if the pool can spare us.
+			if (!woken && this->Retire())
+				break;
 		}
 	}
 
@@ -258,6 +1292,7 @@ void WorkerThread::Main()
 	delete queue;
 #endif
 	threadid = -1;
+	currentWorker = nullptr;
 
 	dbgprintf("Thread %d exiting...\n", this->threadID);
 }